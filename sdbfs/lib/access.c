@@ -11,50 +11,436 @@
 /* To avoid many #ifdef and associated mess, all headers are included there */
 #include "libsdbfs.h"
 
-int sdbfs_fstat(struct sdbfs *fs, struct sdb_device *record_return)
+/* Clip a request to the end of file; nothing at all beyond it */
+static sdbfs_ssize_t __clip(struct sdbfs_file *f, sdbfs_ssize_t offset,
+			    sdbfs_ssize_t count)
+{
+	if (offset >= f->f_len)
+		return 0;
+	if (count > f->f_len - offset)
+		return f->f_len - offset;
+	return count;
+}
+
+int sdbfs_file_stat(struct sdbfs_file *f, struct sdb_device *record_return)
 {
-	if (!fs->currentp)
+	if (!f->fs)
 		return -ENOENT;
-	memcpy(record_return, fs->currentp, sizeof(*record_return));
+	memcpy(record_return, &f->record, sizeof(*record_return));
 	return 0;
 }
 
-int sdbfs_fread(struct sdbfs *fs, int offset, void *buf, int count)
+sdbfs_ssize_t sdbfs_file_read(struct sdbfs_file *f, sdbfs_ssize_t offset,
+			      void *buf, sdbfs_ssize_t count)
 {
-	int ret;
+	struct sdbfs *fs = f->fs;
+	sdbfs_ssize_t ret;
 
-	if (!fs->currentp)
+	if (!fs)
 		return -ENOENT;
 	if (offset < 0)
-		offset = fs->read_offset;
-	if (offset + count > fs->f_len)
-		count = fs->f_len - offset;
+		offset = f->read_offset;
+	count = __clip(f, offset, count);
+	if (!count)
+		return 0;
 	ret = count;
 	if (fs->data)
-		memcpy(buf, fs->data + fs->f_offset + offset, count);
+		memcpy(buf, fs->data + f->f_offset + offset, count);
 	else
-		ret = fs->read(fs, fs->f_offset + offset, buf, count);
+		ret = sdbfs_dev_read(fs, f->f_offset + offset, buf, count);
+#ifndef SDBFS_MINIMAL
+	if (ret > 0 && fs->wcache)
+		sdbfs_wcache_patch(fs, f->f_offset + offset, buf, ret);
+#endif
 	if (ret > 0)
-		fs->read_offset = offset + ret;
+		f->read_offset = offset + ret;
 	return ret;
 }
 
-int sdbfs_fwrite(struct sdbfs *fs, int offset, void *buf, int count)
+/*
+ * If the storage is mapped, return a pointer to file contents instead
+ * of copying them. If datalen is set, the whole file must live within.
+ */
+int sdbfs_file_map(struct sdbfs_file *f, const void **ptr, sdbfs_off_t *len)
 {
-	int ret;
+	struct sdbfs *fs = f->fs;
+
+	if (!fs)
+		return -ENOENT;
+	if (!fs->data && !(fs->flags & SDBFS_F_ZEROBASED))
+		return -ENXIO;
+	if (fs->datalen && (f->f_offset > fs->datalen
+			    || f->f_len > fs->datalen - f->f_offset))
+		return -EFAULT;
+	*ptr = fs->data + f->f_offset;
+	*len = f->f_len;
+	return 0;
+}
+
+#ifndef SDBFS_MINIMAL
+sdbfs_ssize_t sdbfs_file_write(struct sdbfs_file *f, sdbfs_ssize_t offset,
+			       void *buf, sdbfs_ssize_t count)
+{
+	struct sdbfs *fs = f->fs;
+	sdbfs_ssize_t ret;
 
-	if (!fs->currentp)
+	if (!fs)
 		return -ENOENT;
 	if (offset < 0)
-		offset = fs->read_offset;
-	if (offset + count > fs->f_len)
-		count = fs->f_len - offset;
+		offset = f->read_offset;
+	count = __clip(f, offset, count);
+	if (!count)
+		return 0;
 	ret = count;
 	if (fs->data)
-		memcpy(buf, fs->data + fs->f_offset + offset, count);
+		memcpy(fs->data + f->f_offset + offset, buf, count);
+	else if (fs->wcache)
+		ret = sdbfs_wcache_write(fs, f->f_offset + offset, buf, count);
 	else
-		ret = fs->write(fs, fs->f_offset + offset, buf, count);
+		ret = fs->write(fs, f->f_offset + offset, buf, count);
+	if (ret > 0 && fs->rcache)
+		sdbfs_rcache_invalidate(fs, f->f_offset + offset, ret);
 	if (ret > 0)
-		fs->read_offset = offset + ret;
+		f->read_offset = offset + ret;
 	return ret;
 }
+
+/*
+ * Vectored reads: the caller's ranges are sorted by offset (in place),
+ * then ranges that are contiguous both in storage and in memory are
+ * merged, and the driver receives them in batches. Without a readv
+ * method, each merged range is a read of its own.
+ */
+static void __sort_iov(struct sdbfs_iovec *iov, int n)
+{
+	struct sdbfs_iovec tmp;
+	int i, j;
+
+	for (i = 1; i < n; i++) {
+		tmp = iov[i];
+		for (j = i; j > 0 && iov[j - 1].offset > tmp.offset; j--)
+			iov[j] = iov[j - 1];
+		iov[j] = tmp;
+	}
+}
+
+static sdbfs_ssize_t __readv_batch(struct sdbfs *fs, struct sdbfs_iovec *v,
+				   int n)
+{
+	sdbfs_ssize_t ret, done = 0;
+	int i;
+
+	if (fs->readv)
+		return fs->readv(fs, v, n);
+	for (i = 0; i < n; i++) {
+		ret = sdbfs_dev_read(fs, v[i].offset, v[i].buf, v[i].count);
+		if (ret < 0)
+			return done ? done : ret;
+		done += ret;
+	}
+	return done;
+}
+
+/* Offsets in iov are relative to "base" (zero for absolute ones) */
+static sdbfs_ssize_t __readv(struct sdbfs *fs, struct sdbfs_iovec *iov, int n,
+			     sdbfs_off_t base)
+{
+	struct sdbfs_iovec v[SDBFS_IOV_BATCH], *last = NULL;
+	sdbfs_ssize_t ret, done = 0;
+	int i, nv = 0;
+
+	__sort_iov(iov, n);
+	if (fs->data) {
+		for (i = 0; i < n; i++) {
+			memcpy(iov[i].buf, fs->data + base + iov[i].offset,
+			       iov[i].count);
+			done += iov[i].count;
+		}
+		return done;
+	}
+	for (i = 0; i < n; i++) {
+		if (!iov[i].count)
+			continue;
+		if (last && last->offset + last->count == base + iov[i].offset
+		    && last->buf + last->count == iov[i].buf) {
+			last->count += iov[i].count;
+			continue;
+		}
+		if (nv == SDBFS_IOV_BATCH) {
+			ret = __readv_batch(fs, v, nv);
+			if (ret < 0)
+				return done ? done : ret;
+			done += ret;
+			nv = 0;
+		}
+		last = v + nv++;
+		last->offset = base + iov[i].offset;
+		last->buf = iov[i].buf;
+		last->count = iov[i].count;
+	}
+	if (nv) {
+		ret = __readv_batch(fs, v, nv);
+		if (ret < 0)
+			return done ? done : ret;
+		done += ret;
+	}
+	if (fs->wcache)
+		for (i = 0; i < n; i++)
+			sdbfs_wcache_patch(fs, base + iov[i].offset,
+					   iov[i].buf, iov[i].count);
+	return done;
+}
+
+/* Ranges beyond the end of file are clipped (the count is changed) */
+sdbfs_ssize_t sdbfs_file_readv(struct sdbfs_file *f, struct sdbfs_iovec *iov,
+			       int n)
+{
+	int i;
+
+	if (!f->fs)
+		return -ENOENT;
+	for (i = 0; i < n; i++) {
+		if (iov[i].offset >= f->f_len)
+			iov[i].count = 0;
+		else if (iov[i].count > f->f_len - iov[i].offset)
+			iov[i].count = f->f_len - iov[i].offset;
+	}
+	return __readv(f->fs, iov, n, f->f_offset);
+}
+
+/* With absolute offsets, the caller can gather data from several files */
+sdbfs_ssize_t sdbfs_dev_readv(struct sdbfs *fs, struct sdbfs_iovec *iov,
+			      int n)
+{
+	return __readv(fs, iov, n, 0);
+}
+
+/*
+ * Bus reads: each access is the widest one that the device accepts and
+ * the driver offers, at that alignment. Bytes are stored in the byte
+ * order of the device, so the buffer is an image of it. Where only a
+ * narrower access would fit (unaligned head or short tail), the whole
+ * word of the narrowest legal width is read and part of it is used.
+ * Note that the SDB_WB_ACCESS* bits equal the width in bytes.
+ */
+static int __bus_widths(struct sdbfs_file *f)
+{
+	struct sdbfs *fs = f->fs;
+	int mask = 0;
+
+	if (fs->read8)
+		mask |= SDB_WB_ACCESS8;
+	if (fs->read16)
+		mask |= SDB_WB_ACCESS16;
+	if (fs->read32)
+		mask |= SDB_WB_ACCESS32;
+	if (fs->read64)
+		mask |= SDB_WB_ACCESS64;
+	return mask & sdbfs_file_access(f);
+}
+
+static int __bus_read(struct sdbfs *fs, int width, sdbfs_off_t offset,
+		      uint64_t *val)
+{
+	uint8_t v8;
+	uint16_t v16;
+	uint32_t v32;
+	int ret;
+
+	switch (width) {
+	case 1:
+		ret = fs->read8(fs, offset, &v8);
+		*val = v8;
+		break;
+	case 2:
+		ret = fs->read16(fs, offset, &v16);
+		*val = v16;
+		break;
+	case 4:
+		ret = fs->read32(fs, offset, &v32);
+		*val = v32;
+		break;
+	default:
+		ret = fs->read64(fs, offset, val);
+		break;
+	}
+	return ret;
+}
+
+sdbfs_ssize_t sdbfs_file_read_bus(struct sdbfs_file *f, sdbfs_ssize_t offset,
+				  void *buf, sdbfs_ssize_t count)
+{
+	struct sdbfs *fs = f->fs;
+	uint8_t *p = buf, word[8];
+	sdbfs_off_t addr;
+	sdbfs_ssize_t done = 0;
+	int mask, le, narrow, w, in, n, i, ret;
+	uint64_t val;
+
+	if (!fs)
+		return -ENOENT;
+	mask = __bus_widths(f);
+	if (!mask) /* not wishbone, or no hooks: use plain reads */
+		return sdbfs_file_read(f, offset, buf, count);
+	le = sdbfs_file_little_endian(f);
+	if (offset < 0)
+		offset = f->read_offset;
+	count = __clip(f, offset, count);
+	if (!count)
+		return 0;
+	for (narrow = 1; !(mask & narrow); narrow <<= 1)
+		;
+
+	while (done < count) {
+		addr = f->f_offset + offset + done;
+		for (w = 8; w > narrow; w >>= 1)
+			if ((mask & w) && !(addr & (w - 1))
+			    && w <= count - done)
+				break;
+		in = addr & (w - 1);
+		ret = __bus_read(fs, w, addr - in, &val);
+		if (ret < 0)
+			return done ? done : ret;
+		for (i = 0; i < w; i++)
+			word[i] = val >> (8 * (le ? i : w - 1 - i));
+		n = w - in;
+		if (n > count - done)
+			n = count - done;
+		memcpy(p + done, word + in, n);
+		done += n;
+	}
+	f->read_offset = offset + done;
+	return done;
+}
+
+/*
+ * Asynchronous reads: the driver starts the transfer and the caller
+ * goes on; completion is reported through aio->done and aio->busy.
+ * Dirty data in the write cache is flushed first, so the device holds
+ * what the caller expects; the read cache is not involved.
+ */
+void sdbfs_aio_complete(struct sdbfs_aio *aio, sdbfs_ssize_t ret)
+{
+	void (*done)(struct sdbfs_aio *aio) = aio->done;
+
+	/* After busy is cleared, a synchronous waiter may free aio */
+	aio->ret = ret;
+	__atomic_store_n(&aio->busy, 0, __ATOMIC_RELEASE);
+	if (done)
+		done(aio);
+}
+
+sdbfs_ssize_t sdbfs_aio_wait(struct sdbfs_aio *aio)
+{
+	struct sdbfs *fs = aio->fs;
+
+	while (__atomic_load_n(&aio->busy, __ATOMIC_ACQUIRE))
+		if (fs->poll)
+			fs->poll(fs);
+	return aio->ret;
+}
+
+/* This is used as fs->read when the driver only has read_async */
+sdbfs_ssize_t sdbfs_aio_read(struct sdbfs *fs, sdbfs_off_t offset, void *buf,
+			     sdbfs_ssize_t count)
+{
+	struct sdbfs_aio aio;
+	int ret;
+
+	memset(&aio, 0, sizeof(aio));
+	aio.fs = fs;
+	aio.offset = offset;
+	aio.buf = buf;
+	aio.count = count;
+	aio.busy = 1;
+	ret = fs->read_async(fs, &aio);
+	if (ret < 0)
+		return ret;
+	return sdbfs_aio_wait(&aio);
+}
+
+int sdbfs_file_read_async(struct sdbfs_file *f, sdbfs_ssize_t offset,
+			  void *buf, sdbfs_ssize_t count,
+			  struct sdbfs_aio *aio)
+{
+	struct sdbfs *fs = f->fs;
+	int ret;
+
+	if (!fs)
+		return -ENOENT;
+	if (__atomic_load_n(&aio->busy, __ATOMIC_ACQUIRE))
+		return -EBUSY;
+	aio->fs = fs;
+	if (fs->data || !fs->read_async) {
+		/* Nothing to overlap with: complete immediately */
+		sdbfs_aio_complete(aio, sdbfs_file_read(f, offset, buf, count));
+		return 0;
+	}
+	if (fs->wcache) {
+		ret = sdbfs_flush(fs);
+		if (ret < 0)
+			return ret;
+	}
+	if (offset < 0)
+		offset = f->read_offset;
+	count = __clip(f, offset, count);
+	if (!count) {
+		sdbfs_aio_complete(aio, 0);
+		return 0;
+	}
+	aio->offset = f->f_offset + offset;
+	aio->buf = buf;
+	aio->count = count;
+	aio->busy = 1;
+	ret = fs->read_async(fs, aio);
+	if (ret < 0) {
+		aio->busy = 0;
+		return ret;
+	}
+	f->read_offset = offset + count;
+	return 0;
+}
+
+#endif /* SDBFS_MINIMAL */
+
+/* The simple API acts on the file that lives in the device structure */
+int sdbfs_fstat(struct sdbfs *fs, struct sdb_device *record_return)
+{
+	return sdbfs_file_stat(&fs->file, record_return);
+}
+
+sdbfs_ssize_t sdbfs_fread(struct sdbfs *fs, sdbfs_ssize_t offset, void *buf,
+			  sdbfs_ssize_t count)
+{
+	return sdbfs_file_read(&fs->file, offset, buf, count);
+}
+
+int sdbfs_fmap(struct sdbfs *fs, const void **ptr, sdbfs_off_t *len)
+{
+	return sdbfs_file_map(&fs->file, ptr, len);
+}
+
+#ifndef SDBFS_MINIMAL
+sdbfs_ssize_t sdbfs_fwrite(struct sdbfs *fs, sdbfs_ssize_t offset, void *buf,
+			   sdbfs_ssize_t count)
+{
+	return sdbfs_file_write(&fs->file, offset, buf, count);
+}
+
+sdbfs_ssize_t sdbfs_fread_bus(struct sdbfs *fs, sdbfs_ssize_t offset,
+			      void *buf, sdbfs_ssize_t count)
+{
+	return sdbfs_file_read_bus(&fs->file, offset, buf, count);
+}
+
+sdbfs_ssize_t sdbfs_freadv(struct sdbfs *fs, struct sdbfs_iovec *iov, int n)
+{
+	return sdbfs_file_readv(&fs->file, iov, n);
+}
+
+int sdbfs_fread_async(struct sdbfs *fs, sdbfs_ssize_t offset, void *buf,
+		      sdbfs_ssize_t count, struct sdbfs_aio *aio)
+{
+	return sdbfs_file_read_async(&fs->file, offset, buf, count, aio);
+}
+#endif /* SDBFS_MINIMAL */
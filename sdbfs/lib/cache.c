@@ -0,0 +1,396 @@
+/*
+ * Copyright (C) 2014 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * Released according to the GNU GPL, version 2 or any later version.
+ *
+ * This work is part of the White Rabbit project, a research effort led
+ * by CERN, the European Institute for Nuclear Research.
+ */
+
+/* To avoid many #ifdef and associated mess, all headers are included there */
+#include "libsdbfs.h"
+
+/* Caches are not part of the minimal profile (see libsdbfs.h) */
+#ifndef SDBFS_MINIMAL
+
+/*
+ * The write cache collects writes per erase block, so that a flash
+ * device sees one erase and one program call per block, when the
+ * file is closed or the cache is flushed, instead of one call per
+ * fwrite. Like the index, it lives in memory provided by the caller.
+ */
+int sdbfs_wcache_init(struct sdbfs *fs, void *arena, unsigned long size)
+{
+	struct sdbfs_wcache *wc;
+	unsigned long p, end, bs = fs->blocksize;
+	int i, n;
+
+	fs->wcache = NULL;
+	if (!bs || fs->data || !fs->read || !fs->write)
+		return -EINVAL;
+	p = ((unsigned long)arena + 7) & ~7UL;
+	end = (unsigned long)arena + size;
+	wc = (void *)p;
+	p = (p + sizeof(*wc) + 7) & ~7UL;
+	if (p >= end)
+		return -ENOMEM;
+	n = (end - p) / (sizeof(struct sdbfs_wslot) + bs);
+	if (n < 1)
+		return -ENOMEM;
+
+	wc->nslots = n;
+	wc->stamp = 0;
+	wc->slots = (void *)p;
+	p += n * sizeof(struct sdbfs_wslot);
+	for (i = 0; i < n; i++, p += bs) {
+		memset(wc->slots + i, 0, sizeof(wc->slots[i]));
+		wc->slots[i].data = (void *)p;
+	}
+	fs->wcache = wc;
+	return 0;
+}
+
+static void __rcache_invalidate(struct sdbfs_rcache *rc, sdbfs_off_t offset,
+				sdbfs_off_t count);
+
+/* Erase the block and program it in a whole, or just write the dirty part */
+static int __flush_slot(struct sdbfs *fs, struct sdbfs_wslot *s)
+{
+	unsigned long bs = fs->blocksize;
+	sdbfs_ssize_t ret;
+
+	if (s->lo == s->hi)
+		return 0;
+	if (fs->erase) {
+		ret = fs->erase(fs, s->addr, bs);
+		if (ret >= 0)
+			ret = fs->write(fs, s->addr, s->data, bs);
+	} else {
+		ret = fs->write(fs, s->addr + s->lo, s->data + s->lo,
+				s->hi - s->lo);
+	}
+	if (fs->rcache)
+		__rcache_invalidate(fs->rcache, s->addr, bs);
+	if (ret < 0)
+		return ret;
+	s->lo = s->hi = 0;
+	return 0;
+}
+
+/* Find the slot for a block, or recycle the least recently used one */
+static struct sdbfs_wslot *__get_slot(struct sdbfs *fs, sdbfs_off_t addr,
+				      int whole)
+{
+	struct sdbfs_wcache *wc = fs->wcache;
+	struct sdbfs_wslot *s, *lru = NULL;
+	int i;
+
+	for (i = 0, s = wc->slots; i < wc->nslots; i++, s++) {
+		if (s->valid && s->addr == addr)
+			return s;
+		if (!lru || !s->valid || (lru->valid && s->stamp < lru->stamp))
+			lru = s;
+	}
+	s = lru;
+	if (s->valid && __flush_slot(fs, s) < 0)
+		return NULL;
+	s->valid = 0;
+	s->addr = addr;
+	/* Unless we overwrite all of it, we need the current content */
+	if (!whole && fs->read(fs, addr, s->data, fs->blocksize)
+	    != fs->blocksize)
+		return NULL;
+	s->valid = 1;
+	return s;
+}
+
+sdbfs_ssize_t sdbfs_wcache_write(struct sdbfs *fs, sdbfs_off_t offset,
+				 void *buf, sdbfs_ssize_t count)
+{
+	struct sdbfs_wcache *wc = fs->wcache;
+	struct sdbfs_wslot *s;
+	unsigned long bs = fs->blocksize, in, n;
+	sdbfs_off_t addr;
+	sdbfs_ssize_t done = 0;
+
+	if (count <= 0)
+		return 0; /* e.g., at the end of file */
+	sdbfs_lock(&fs->lock);
+	while (done < count) {
+		addr = offset - offset % bs;
+		in = offset - addr;
+		n = bs - in;
+		if (n > count - done)
+			n = count - done;
+		s = __get_slot(fs, addr, n == bs);
+		if (!s)
+			break;
+		memcpy(s->data + in, buf + done, n);
+		/* Merge with the current dirty range, if any */
+		if (s->lo == s->hi) {
+			s->lo = in;
+			s->hi = in + n;
+		} else {
+			if (in < s->lo)
+				s->lo = in;
+			if (in + n > s->hi)
+				s->hi = in + n;
+		}
+		s->stamp = ++wc->stamp;
+		offset += n;
+		done += n;
+	}
+	sdbfs_unlock(&fs->lock);
+	return done ? done : -EIO;
+}
+
+/* Reads from the device must see what is still in the cache */
+void sdbfs_wcache_patch(struct sdbfs *fs, sdbfs_off_t offset, void *buf,
+			sdbfs_ssize_t count)
+{
+	struct sdbfs_wcache *wc = fs->wcache;
+	struct sdbfs_wslot *s;
+	sdbfs_off_t from, to;
+	int i;
+
+	sdbfs_lock(&fs->lock);
+	for (i = 0, s = wc->slots; i < wc->nslots; i++, s++) {
+		if (!s->valid || s->lo == s->hi)
+			continue;
+		from = s->addr + s->lo;
+		to = s->addr + s->hi;
+		if (from < offset)
+			from = offset;
+		if (to > offset + count)
+			to = offset + count;
+		if (from < to)
+			memcpy(buf + (from - offset),
+			       s->data + (from - s->addr), to - from);
+	}
+	sdbfs_unlock(&fs->lock);
+}
+
+/*
+ * Write out dirty blocks, in address order. A block that can't be
+ * written stays dirty, so the next flush tries again; we return the
+ * first error.
+ */
+int sdbfs_flush(struct sdbfs *fs)
+{
+	struct sdbfs_wcache *wc = fs->wcache;
+	struct sdbfs_wslot *s, *next;
+	sdbfs_off_t from = 0;
+	int i, err, ret = 0;
+
+	if (!wc)
+		return 0;
+	sdbfs_lock(&fs->lock);
+	do {
+		next = NULL;
+		for (i = 0, s = wc->slots; i < wc->nslots; i++, s++) {
+			if (!s->valid || s->lo == s->hi || s->addr < from)
+				continue;
+			if (!next || s->addr < next->addr)
+				next = s;
+		}
+		if (!next)
+			break;
+		from = next->addr + fs->blocksize;
+		err = __flush_slot(fs, next);
+		if (err < 0 && !ret)
+			ret = err;
+	} while (next);
+	sdbfs_unlock(&fs->lock);
+	return ret;
+}
+
+/*
+ * The read cache sits between the library and a slow driver. Lines are
+ * fs->blocksize long, unless the caller asks for a different size,
+ * and they all live in a single array, so read-ahead can fill several
+ * contiguous lines with a single driver call.
+ */
+int sdbfs_rcache_init(struct sdbfs *fs, void *arena, unsigned long size,
+		      unsigned long linesize)
+{
+	struct sdbfs_rcache *rc;
+	unsigned long p, end;
+	int i, n;
+
+	fs->rcache = NULL;
+	if (!linesize)
+		linesize = fs->blocksize;
+	if (!linesize || fs->data || !fs->read)
+		return -EINVAL;
+	p = ((unsigned long)arena + 7) & ~7UL;
+	end = (unsigned long)arena + size;
+	rc = (void *)p;
+	p = (p + sizeof(*rc) + 7) & ~7UL;
+	if (p >= end)
+		return -ENOMEM;
+	n = (end - p) / (sizeof(struct sdbfs_rline) + linesize);
+	if (n < 1)
+		return -ENOMEM;
+
+	memset(rc, 0, sizeof(*rc));
+	rc->nlines = n;
+	rc->linesize = linesize;
+	rc->ra = 1;
+	rc->lines = (void *)p;
+	rc->data = (void *)(p + n * sizeof(struct sdbfs_rline));
+	for (i = 0; i < n; i++)
+		rc->lines[i].valid = 0;
+	fs->rcache = rc;
+	return 0;
+}
+
+static struct sdbfs_rline *__rcache_lookup(struct sdbfs_rcache *rc,
+					   sdbfs_off_t addr)
+{
+	int i, n = rc->nlines;
+
+	/* Sequential readers hit the last line or the following one */
+	for (i = 0; i < n; i++) {
+		struct sdbfs_rline *l = rc->lines + (rc->last + i) % n;
+
+		if (l->valid && l->addr == addr) {
+			rc->last = l - rc->lines;
+			return l;
+		}
+	}
+	return NULL;
+}
+
+/* Choose "n" contiguous lines, whose most recent use is the oldest */
+static int __rcache_victim(struct sdbfs_rcache *rc, int n)
+{
+	unsigned long age, best = 0;
+	int i, j, ret = 0;
+
+	for (i = 0; i + n <= rc->nlines; i++) {
+		for (j = i, age = 0; j < i + n; j++) {
+			if (!rc->lines[j].valid)
+				continue;
+			if (rc->lines[j].stamp + 1 > age)
+				age = rc->lines[j].stamp + 1;
+		}
+		if (i == 0 || age < best) {
+			best = age;
+			ret = i;
+		}
+		if (!best)
+			break; /* all free: can't do better */
+	}
+	return ret;
+}
+
+/* Fill lines for addr (and more, if read-ahead says so) */
+static struct sdbfs_rline *__rcache_fill(struct sdbfs *fs,
+					 sdbfs_off_t addr)
+{
+	struct sdbfs_rcache *rc = fs->rcache;
+	unsigned long ls = rc->linesize;
+	sdbfs_ssize_t ret;
+	int i, n, first;
+
+	/* A sequential miss doubles the read-ahead, a random one resets it */
+	if (addr == rc->next) {
+		if (rc->ra * 2 <= rc->nlines / 2)
+			rc->ra *= 2;
+	} else {
+		rc->ra = 1;
+	}
+	n = rc->ra;
+	/* Don't read again what is already there */
+	for (i = 1; i < n; i++)
+		if (__rcache_lookup(rc, addr + i * ls))
+			break;
+	n = i;
+
+	first = __rcache_victim(rc, n);
+	for (i = 0; i < n; i++)
+		rc->lines[first + i].valid = 0;
+	rc->reads++;
+	ret = fs->read(fs, addr, rc->data + first * ls, n * ls);
+	if (ret < (sdbfs_ssize_t)ls)
+		return NULL;
+	n = ret / ls; /* the device may be shorter than the read-ahead */
+	for (i = 0; i < n; i++) {
+		rc->lines[first + i].addr = addr + i * ls;
+		rc->lines[first + i].stamp = ++rc->stamp;
+		rc->lines[first + i].valid = 1;
+	}
+	rc->next = addr + n * ls;
+	rc->last = first;
+	return rc->lines + first;
+}
+
+/* All library reads from a non-mapped device go through here */
+sdbfs_ssize_t sdbfs_dev_read(struct sdbfs *fs, sdbfs_off_t offset, void *buf,
+			     sdbfs_ssize_t count)
+{
+	struct sdbfs_rcache *rc = fs->rcache;
+	struct sdbfs_rline *l;
+	unsigned long ls, in, n;
+	sdbfs_off_t addr;
+	sdbfs_ssize_t ret, done = 0;
+
+	if (!rc)
+		return fs->read(fs, offset, buf, count);
+	ls = rc->linesize;
+	/* Huge reads would only flush the cache: pass them through */
+	if (count >= rc->nlines * ls / 2)
+		return fs->read(fs, offset, buf, count);
+
+	sdbfs_lock(&fs->lock);
+	while (done < count) {
+		addr = offset - offset % ls;
+		in = offset - addr;
+		n = ls - in;
+		if (n > count - done)
+			n = count - done;
+		l = __rcache_lookup(rc, addr);
+		if (l) {
+			rc->hits++;
+		} else {
+			rc->misses++;
+			l = __rcache_fill(fs, addr);
+		}
+		if (!l) {
+			/* Maybe the end of the device: try uncached */
+			sdbfs_unlock(&fs->lock);
+			ret = fs->read(fs, offset, buf + done, count - done);
+			return ret > 0 ? done + ret : (done ? done : ret);
+		}
+		l->stamp = ++rc->stamp;
+		memcpy(buf + done, rc->data + (l - rc->lines) * ls + in, n);
+		offset += n;
+		done += n;
+	}
+	sdbfs_unlock(&fs->lock);
+	return done;
+}
+
+static void __rcache_invalidate(struct sdbfs_rcache *rc, sdbfs_off_t offset,
+				sdbfs_off_t count)
+{
+	struct sdbfs_rline *l;
+	int i;
+
+	for (i = 0, l = rc->lines; i < rc->nlines; i++, l++)
+		if (l->valid && l->addr < offset + count
+		    && l->addr + rc->linesize > offset)
+			l->valid = 0;
+}
+
+void sdbfs_rcache_invalidate(struct sdbfs *fs, sdbfs_off_t offset,
+			     sdbfs_off_t count)
+{
+	if (!fs->rcache)
+		return;
+	sdbfs_lock(&fs->lock);
+	__rcache_invalidate(fs->rcache, offset, count);
+	sdbfs_unlock(&fs->lock);
+}
+#endif /* SDBFS_MINIMAL */
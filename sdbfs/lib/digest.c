@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2014 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * Released according to the GNU GPL, version 2 or any later version.
+ *
+ * This work is part of the White Rabbit project, a research effort led
+ * by CERN, the European Institute for Nuclear Research.
+ */
+
+/* To avoid many #ifdef and associated mess, all headers are included there */
+#include "libsdbfs.h"
+
+/* Digests are not part of the minimal profile (see libsdbfs.h) */
+#ifndef SDBFS_MINIMAL
+
+/*
+ * CRC32C (Castagnoli), as used by iSCSI and ext4. The instruction set
+ * computes it directly on x86 (SSE4.2) and on ARMv8; elsewhere we use
+ * slice-by-8 tables, built at first use.
+ */
+#define CRC32C_POLY	0x82f63b78 /* reflected */
+
+#if defined(__x86_64__) && defined(__GNUC__) \
+	&& (defined(__SSE4_2__) || SDB_USER)
+#  define CRC32C_X86
+#endif
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#  include <arm_acle.h>
+#  define CRC32C_ARM
+#endif
+
+static uint32_t crc32c_table[8][256];
+/* 1: tables, 2: instructions; set last, with release (read unlocked) */
+static int crc32c_ready;
+SDBFS_DEFINE_LOCK(crc32c_lock);
+
+static void crc32c_init(void)
+{
+	uint32_t (*t)[256] = crc32c_table;
+	uint32_t c;
+	int i, j;
+
+	sdbfs_lock(&crc32c_lock);
+	if (crc32c_ready)
+		goto out;
+#if defined(CRC32C_ARM) || (defined(CRC32C_X86) && defined(__SSE4_2__))
+	__atomic_store_n(&crc32c_ready, 2, __ATOMIC_RELEASE);
+	goto out;
+#elif defined(CRC32C_X86)
+	if (__builtin_cpu_supports("sse4.2")) {
+		__atomic_store_n(&crc32c_ready, 2, __ATOMIC_RELEASE);
+		goto out;
+	}
+#endif
+	for (i = 0; i < 256; i++) {
+		for (c = i, j = 0; j < 8; j++)
+			c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+		t[0][i] = c;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			t[j][i] = (t[j - 1][i] >> 8) ^ t[0][t[j - 1][i] & 0xff];
+	__atomic_store_n(&crc32c_ready, 1, __ATOMIC_RELEASE);
+out:
+	sdbfs_unlock(&crc32c_lock);
+}
+
+/* Storage order is little-endian here, whatever the host is */
+static inline uint32_t crc32c_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, unsigned long len)
+{
+	uint32_t (*t)[256] = crc32c_table;
+	uint32_t lo, hi;
+
+	for (; len && ((unsigned long)p & 7); len--)
+		crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	for (; len >= 8; len -= 8, p += 8) {
+		lo = crc ^ crc32c_le32(p);
+		hi = crc32c_le32(p + 4);
+		crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff]
+			^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+			^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff]
+			^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+	}
+	for (; len; len--)
+		crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(CRC32C_X86)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, unsigned long len)
+{
+	uint64_t c;
+
+	for (; len && ((unsigned long)p & 7); len--)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+	for (c = crc; len >= 8; len -= 8, p += 8)
+		c = __builtin_ia32_crc32di(c, *(const uint64_t *)p);
+	for (crc = c; len; len--)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+	return crc;
+}
+#elif defined(CRC32C_ARM)
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, unsigned long len)
+{
+	for (; len && ((unsigned long)p & 7); len--)
+		crc = __crc32cb(crc, *p++);
+	for (; len >= 8; len -= 8, p += 8)
+		crc = __crc32cd(crc, *(const uint64_t *)p);
+	for (; len; len--)
+		crc = __crc32cb(crc, *p++);
+	return crc;
+}
+#else
+#  define crc32c_hw crc32c_sw /* never called */
+#endif
+
+/* Start with 0, and pass the previous result to continue a stream */
+uint32_t sdbfs_crc32c(uint32_t crc, const void *buf, unsigned long len)
+{
+	int ready = __atomic_load_n(&crc32c_ready, __ATOMIC_ACQUIRE);
+
+	if (!ready) {
+		crc32c_init();
+		ready = __atomic_load_n(&crc32c_ready, __ATOMIC_ACQUIRE);
+	}
+	if (ready == 2)
+		return ~crc32c_hw(~crc, buf, len);
+	return ~crc32c_sw(~crc, buf, len);
+}
+
+/*
+ * Check a file against its digest record: 0 if it matches, -EBADMSG
+ * if not, -ENOENT if there is no digest. Mapped devices are checked
+ * in place, others are read in chunks (and through the read cache).
+ */
+int sdbfs_file_verify(struct sdbfs_file *f)
+{
+	struct sdbfs_digest d;
+	uint8_t buf[SDBFS_VERIFY_CHUNK];
+	const uint8_t *p;
+	sdbfs_off_t len, maplen, done;
+	sdbfs_ssize_t ret;
+	unsigned long n;
+	uint32_t crc = 0;
+
+	if (!f->fs)
+		return -ENOENT;
+	/* Empty files may be placed outside of their directory's range */
+	if (!f->f_len)
+		return 0;
+	ret = sdbfs_file_digest(f, &d);
+	if (ret < 0)
+		return ret;
+	if (ntohl(d.algo) != SDBFS_DIGEST_CRC32C)
+		return -EINVAL;
+	len = ntohll(d.length);
+	if (len > f->f_len)
+		return -EBADMSG;
+
+	if (sdbfs_file_map(f, (const void **)&p, &maplen) == 0) {
+		for (done = 0; done < len; done += n) {
+			n = len - done > (1 << 30) ? 1 << 30 : len - done;
+			crc = sdbfs_crc32c(crc, p + done, n);
+		}
+	} else {
+		for (done = 0; done < len; done += n) {
+			n = len - done > sizeof(buf) ? sizeof(buf) : len - done;
+			ret = sdbfs_file_read(f, done, buf, n);
+			if (ret < 0)
+				return ret;
+			if (ret != n)
+				return -EIO;
+			crc = sdbfs_crc32c(crc, buf, n);
+		}
+	}
+	return crc == ntohl(d.digest) ? 0 : -EBADMSG;
+}
+
+int sdbfs_fverify(struct sdbfs *fs)
+{
+	return sdbfs_file_verify(&fs->file);
+}
+
+#endif /* SDBFS_MINIMAL */
@@ -12,12 +12,19 @@
 #include "libsdbfs.h"
 
 static struct sdbfs *sdbfs_list;
+SDBFS_DEFINE_LOCK(sdbfs_list_lock);
 
 /* All fields unused by the caller are expected to be zeroed */
 int sdbfs_dev_create(struct sdbfs *fs)
 {
 	unsigned int magic;
 
+#ifndef SDBFS_MINIMAL
+	/* Synchronous reads can be built on asynchronous ones */
+	if (!fs->data && !fs->read && fs->read_async)
+		fs->read = sdbfs_aio_read;
+#endif
+
 	/* First, check we have the magic */
 	if (fs->data || (fs->flags & SDBFS_F_ZEROBASED))
 		magic = *(unsigned int *)(fs->data + fs->entrypoint);
@@ -25,6 +32,8 @@ int sdbfs_dev_create(struct sdbfs *fs)
 		fs->read(fs, fs->entrypoint, &magic, sizeof(magic));
 	if (magic == SDB_MAGIC) {
 		/* Uh! If we are little-endian, we must convert */
+		if (ntohl(1) != 1 && !SDBFS_CAN_CONVERT32)
+			return -ENOTDIR; /* compiled out */
 		if (ntohl(1) != 1)
 			fs->flags |= SDBFS_F_CONVERT32;
 	} else if (htonl(magic) == SDB_MAGIC) {
@@ -33,8 +42,13 @@ int sdbfs_dev_create(struct sdbfs *fs)
 		return -ENOTDIR;
 	}
 
+	sdbfs_lock(&sdbfs_list_lock);
+#ifndef SDBFS_MINIMAL
+	sdbfs_lock_init(&fs->lock);
+#endif
 	fs->next = sdbfs_list;
 	sdbfs_list = fs;
+	sdbfs_unlock(&sdbfs_list_lock);
 
 	return 0;
 }
@@ -42,222 +56,922 @@ int sdbfs_dev_create(struct sdbfs *fs)
 int sdbfs_dev_destroy(struct sdbfs *fs)
 {
 	struct sdbfs **p;
+	int ret = 0;
 
+	sdbfs_lock(&sdbfs_list_lock);
 	for (p = &sdbfs_list; *p && *p != fs; p = &(*p)->next)
 		;
-	if (!*p)
-		return -ENOENT;
-	*p = fs->next;
-	return 0;
+	if (*p)
+		*p = fs->next;
+	else
+		ret = -ENOENT;
+	sdbfs_unlock(&sdbfs_list_lock);
+	return ret;
 }
 
 struct sdbfs *sdbfs_dev_find(const char *name)
 {
 	struct sdbfs *l;
 
+	sdbfs_lock(&sdbfs_list_lock);
 	for (l = sdbfs_list; l && strcmp(l->name, name); l = l->next)
 		;
-	if (!l)
-		return NULL;
+	sdbfs_unlock(&sdbfs_list_lock);
 	return l;
 }
 
+#ifndef SDBFS_MINIMAL
+/*
+ * Looking for the entry point in a raw image: the magic may only be
+ * at the beginning of a 64-byte record, so we check one word every
+ * 16, four records per iteration. Then the table must make sense.
+ */
+#define SDBFS_SEARCH_CHUNK	512 /* bytes, when reading from the device */
+
+static const struct sdb_device *sdbfs_search_record(struct sdbfs *fs,
+						    sdbfs_off_t offset,
+						    struct sdb_device *tmp)
+{
+	if (fs->data || (fs->flags & SDBFS_F_ZEROBASED))
+		return fs->data + offset;
+	if (fs->read(fs, offset, tmp, sizeof(*tmp)) != sizeof(*tmp))
+		return NULL;
+	return tmp;
+}
+
+static int sdbfs_search_valid(struct sdbfs *fs, sdbfs_off_t offset,
+			      int convert)
+{
+	const struct sdb_device *v;
+	struct sdb_device tmp;
+	int i, n, type;
+
+	v = sdbfs_search_record(fs, offset, &tmp);
+	if (!v || __sdbfs_get8(v, 0x3f, convert) != sdb_type_interconnect)
+		return 0;
+	n = __sdbfs_get16(v, 0x04, convert);
+	if (n < 1 || offset + n * sizeof(*v) > fs->datalen)
+		return 0;
+	for (i = 1; i < n; i++) {
+		v = sdbfs_search_record(fs, offset + i * sizeof(*v), &tmp);
+		if (!v)
+			return 0;
+		type = __sdbfs_get8(v, 0x3f, convert);
+		if (type & 0x80)
+			continue; /* metadata */
+		if (type != sdb_type_device && type != sdb_type_bridge)
+			return 0;
+		if (__sdbfs_get64(v, 0x08, convert)
+		    > __sdbfs_get64(v, 0x10, convert))
+			return 0;
+	}
+	return 1;
+}
+
+/* Return the index of the first record that starts with the magic */
+static int sdbfs_search_words(const uint32_t *w, int nrecords)
+{
+	const uint32_t m1 = htonl(SDB_MAGIC);
+	const uint32_t m2 = SDBFS_CAN_CONVERT32 ? SDB_MAGIC : m1;
+	int i;
+
+	for (i = 0; i + 4 <= nrecords; i += 4, w += 64)
+		if ((w[0] == m1) | (w[0] == m2) | (w[16] == m1) | (w[16] == m2)
+		    | (w[32] == m1) | (w[32] == m2)
+		    | (w[48] == m1) | (w[48] == m2))
+			break;
+	for (; i < nrecords; i++, w += 16)
+		if (w[0] == m1 || w[0] == m2)
+			return i;
+	return -1;
+}
+
+int sdbfs_find_entry(struct sdbfs *fs)
+{
+	uint32_t buf[SDBFS_SEARCH_CHUNK / 4];
+	const uint32_t *w;
+	sdbfs_off_t offset, size;
+	int i, mapped;
+
+	mapped = fs->data || (fs->flags & SDBFS_F_ZEROBASED);
+	if (!fs->datalen || (!mapped && !fs->read))
+		return -EINVAL;
+	offset = (fs->entrypoint + 63) & ~(sdbfs_off_t)63;
+	while (offset + sizeof(struct sdb_device) <= fs->datalen) {
+		size = fs->datalen - offset;
+		if (size > (1 << 30))
+			size = 1 << 30; /* so records are counted in an int */
+		if (mapped) {
+			w = fs->data + offset;
+		} else {
+			if (size > sizeof(buf))
+				size = sizeof(buf);
+			if (fs->read(fs, offset, buf, size) != size)
+				return -EIO;
+			w = buf;
+		}
+		i = sdbfs_search_words(w, size / sizeof(struct sdb_device));
+		if (i < 0) {
+			offset += size & ~(sdbfs_off_t)63;
+			continue;
+		}
+		w += i * 16;
+		offset += i * sizeof(struct sdb_device);
+		/* Word-swapped storage looks native on little-endian hosts */
+		if (sdbfs_search_valid(fs, offset,
+				       w[0] == SDB_MAGIC && ntohl(1) != 1)) {
+			fs->entrypoint = offset;
+			return 0;
+		}
+		offset += sizeof(struct sdb_device);
+	}
+	return -ENOTDIR;
+}
+#endif /* SDBFS_MINIMAL */
+
 /*
- * To open by name or by ID we need to scan the tree. The scan
- * function is also exported in order for "sdb-ls" to use it
+ * To open by name or by ID we need to scan the tree (unless an index
+ * was built). The scan function is also exported in order for "sdb-ls"
+ * to use it. All scanning state lives in an iterator: the device has
+ * its own one, for the simple API, but users can have more.
  */
 
-static struct sdb_device *sdbfs_readentry(struct sdbfs *fs,
-					  unsigned long offset)
+static const struct sdb_device *sdbfs_readentry(struct sdbfs_iter *it,
+						sdbfs_off_t offset,
+						int depth)
 {
+	struct sdbfs *fs = it->fs;
+
 	/*
 	 * This function reads an entry from a known good offset. It
-	 * returns the pointer to the entry, which may be stored in
-	 * the fs structure itself. Only touches fs->current_record.
+	 * returns the pointer to the raw entry (see sdbfs_view_* in
+	 * the header), which may be stored in the iterator itself.
+	 * Only touches it->raw_record. If the table at this depth was
+	 * read in a whole, use it.
 	 */
-	if (fs->data || (fs->flags & SDBFS_F_ZEROBASED)) {
-		if (!(fs->flags & SDBFS_F_CONVERT32))
-			return (struct sdb_device *)(fs->data + offset);
-		/* copy to local storage for conversion */
-		memcpy(&fs->current_record, fs->data + offset,
-		       sizeof(fs->current_record));
-	} else {
-		if (!fs->read)
-			return NULL;
-		fs->read(fs, offset, &fs->current_record,
-			 sizeof(fs->current_record));
-	}
+	if (fs->data || (fs->flags & SDBFS_F_ZEROBASED))
+		return fs->data + offset;
+#ifndef SDBFS_MINIMAL
+	if (depth >= 0 && it->lv[depth].table)
+		return it->lv[depth].table + (offset - it->lv[depth].tstart);
+#endif
+	if (!fs->read)
+		return NULL;
+	sdbfs_dev_read(fs, offset, &it->raw_record, sizeof(it->raw_record));
+	return &it->raw_record;
+}
 
-	if (fs->flags & SDBFS_F_CONVERT32) {
-		uint32_t *p = (void *)&fs->current_record;
-		int i;
+#if SDBFS_CAN_CONVERT32
+/* Swap 32-bit words while copying: "n" is a multiple of 4 */
+static void sdbfs_swab32_block(uint32_t *to, const uint32_t *from, int n)
+{
+	for (; n > 0; n -= 4, to += 4, from += 4) {
+		to[0] = ntohl(from[0]);
+		to[1] = ntohl(from[1]);
+		to[2] = ntohl(from[2]);
+		to[3] = ntohl(from[3]);
+	}
+}
+#endif
 
-		for (i = 0; i < sizeof(fs->current_record) / sizeof(*p); i++)
-			p[i] = ntohl(p[i]);
+/* Return a converted record: only copy and swap when really needed */
+static struct sdb_device *sdbfs_record(struct sdbfs_iter *it,
+				       const struct sdb_device *v)
+{
+#if SDBFS_CAN_CONVERT32
+	if (sdbfs_convert32(it->fs)) {
+		sdbfs_swab32_block((void *)&it->current_record,
+				   (const void *)v,
+				   sizeof(*v) / sizeof(uint32_t));
+		return &it->current_record;
 	}
+#endif
+	return (struct sdb_device *)v;
+}
 
-	return &fs->current_record;
+#ifndef SDBFS_MINIMAL
+/*
+ * If the caller gave us a buffer, read the table of a directory in
+ * a single driver call. Tables are stacked in the buffer by depth,
+ * if one doesn't fit we fall back to reading one record at a time.
+ */
+static void scan_readtable(struct sdbfs_iter *it, int depth, int nrecords)
+{
+	struct sdbfs *fs = it->fs;
+	struct sdbfs_level *l = it->lv + depth;
+	unsigned long start, size;
+
+	start = depth ? l[-1].tused : 0;
+	size = nrecords * sizeof(struct sdb_device);
+	l->table = NULL;
+	l->tused = start;
+
+	if (fs->data || (fs->flags & SDBFS_F_ZEROBASED) || !it->tblbuf)
+		return; /* nothing to gain */
+	if (!nrecords || start + size > it->tblsize)
+		return;
+	if (sdbfs_dev_read(fs, l->this, it->tblbuf + start, size) != size)
+		return;
+	l->table = it->tblbuf + start;
+	l->tstart = l->this;
+	l->tused = start + size;
 }
 
+/* Skipping a subtree is only supported in the full profile, too */
+static int sdbfs_take_skip(struct sdbfs_iter *it)
+{
+	int ret = it->skip;
+
+	it->skip = 0;
+	return ret;
+}
+#else
+#define sdbfs_take_skip(it) 0
+#endif /* SDBFS_MINIMAL */
+
 /* Helper for scanning: we enter a new directory, and we must validate */
-static struct sdb_device *scan_newdir(struct sdbfs *fs, int depth)
+static const struct sdb_device *scan_newdir(struct sdbfs_iter *it, int depth)
 {
-	struct sdb_device *dev;
-	struct sdb_interconnect *intercon;
+	struct sdbfs *fs = it->fs;
+	struct sdbfs_level *l = it->lv + depth;
+	const struct sdb_device *v;
 
-	dev = fs->currentp = sdbfs_readentry(fs, fs->this[depth]);
-	if (dev->sdb_component.product.record_type != sdb_type_interconnect)
+	v = it->currentp = sdbfs_readentry(it, l->this, -1);
+	if (sdbfs_view_type(fs, v) != sdb_type_interconnect)
 		return NULL;
-
-	intercon = (typeof(intercon))dev;
-	if (ntohl(intercon->sdb_magic) != SDB_MAGIC)
+	if (sdbfs_view_magic(fs, v) != SDB_MAGIC)
 		return NULL;
 
-	fs->nleft[depth] = ntohs(intercon->sdb_records) - 1;
-	fs->this[depth] += sizeof(*intercon);
-	fs->depth = depth;
-	return dev;
+	l->nleft = sdbfs_view_records(fs, v) - 1;
+	l->bus = sdbfs_view_bus_type(fs, v);
+	l->this += sizeof(*v);
+	it->depth = depth;
+#ifndef SDBFS_MINIMAL
+	scan_readtable(it, depth, l->nleft);
+#endif
+	return v;
 }
 
-struct sdb_device *sdbfs_scan(struct sdbfs *fs, int newscan)
+const struct sdb_device *sdbfs_iter_view(struct sdbfs_iter *it, int newscan)
 {
 	/*
 	 * This returns a pointer to the next sdb record, or the first one.
 	 * Subdirectories (bridges) are returned before their contents.
-	 * It only uses internal fields.
+	 * It only uses the iterator and read-only fields of the device.
+	 * The record is raw: use the sdbfs_view_* accessors to read it.
 	 */
-	struct sdb_device *dev;
-	struct sdb_bridge *bridge;
-	int depth, type, newdir = 0; /* check there's the magic */
+	struct sdbfs *fs = it->fs;
+	const struct sdb_device *v;
+	struct sdbfs_level *l;
+	int depth, newdir = 0; /* check there's the magic */
 
 	if (newscan) {
-		fs->base[0] = 0;
-		fs->this[0] = fs->entrypoint;
-		depth = fs->depth = 0;
+		it->lv = it->levels;
+		it->nlevels = SDBFS_DEPTH;
+#ifndef SDBFS_MINIMAL
+		if (it->stack && it->maxdepth > 0) {
+			it->lv = it->stack;
+			it->nlevels = it->maxdepth;
+		}
+		it->skip = 0;
+#endif
+		it->err = 0;
+		it->lv[0].base = 0;
+		it->lv[0].this = fs->entrypoint;
+		depth = it->depth = 0;
 		newdir = 1;
 		goto scan;
 	}
 
 	/* If we already returned a bridge, go inside it (check type) */
-	depth = fs->depth;
-	type = fs->currentp->sdb_component.product.record_type;
-
-	if (type == sdb_type_bridge && depth + 1 < SDBFS_DEPTH) {
-		bridge = (typeof(bridge))fs->currentp;
-		fs->this[depth + 1] = fs->base[depth]
-			+ ntohll(bridge->sdb_child);
-		fs->base[depth + 1] = fs->base[depth]
-			+ ntohll(bridge->sdb_component.addr_first);
-		depth++;
-		newdir++;
+	depth = it->depth;
+	v = it->currentp;
+
+	/* ...unless the caller doesn't want this subtree */
+	if (!sdbfs_take_skip(it)
+	    && sdbfs_view_type(fs, v) == sdb_type_bridge) {
+		l = it->lv + depth;
+		if (depth + 1 < it->nlevels) {
+			l[1].this = l->base + sdbfs_view_child(fs, v);
+			l[1].base = l->base + sdbfs_view_first(fs, v);
+			depth++;
+			newdir++;
+		} else {
+			it->err = -E2BIG; /* but go on with the rest */
+		}
 	}
 
 scan:
 	/* If entering a new directory, verify magic and set nleft */
 	if (newdir) {
-		dev = scan_newdir(fs, depth);
-		if (dev)
-			goto out;
+		v = scan_newdir(it, depth);
+		if (v)
+			return v;
 		/* Otherwise the directory is not there: no intercon */
 		if (!depth)
 			return NULL; /* no entries at all */
 		depth--;
 	}
 
-	while (fs->nleft[depth] == 0) {
+	while (it->lv[depth].nleft == 0) {
 		/* No more at this level, "cd .." if possible */
 		if (!depth)
 			return NULL;
-		fs->depth = --depth;
+		it->depth = --depth;
 	}
 
 	/* so, read the next entry */
-	dev = fs->currentp = sdbfs_readentry(fs, fs->this[depth]);
-	fs->this[depth] += sizeof(*dev);
-	fs->nleft[depth]--;
-out:
-	fs->f_offset = fs->base[fs->depth]
-		+ htonll(fs->currentp->sdb_component.addr_first);
-	return dev;
+	l = it->lv + depth;
+	v = it->currentp = sdbfs_readentry(it, l->this, depth);
+	l->this += sizeof(*v);
+	l->nleft--;
+	return v;
 }
 
-static void __open(struct sdbfs *fs)
+/* The converted flavour, that was here before views were introduced */
+struct sdb_device *sdbfs_iter_scan(struct sdbfs_iter *it, int newscan)
 {
-	fs->f_offset = fs->base[fs->depth]
-		+ htonll(fs->currentp->sdb_component.addr_first);
-	fs->f_len = htonll(fs->currentp->sdb_component.addr_last)
-		+ 1 - htonll(fs->currentp->sdb_component.addr_first);
-	fs->read_offset = 0;
+	const struct sdb_device *v = sdbfs_iter_view(it, newscan);
+
+	if (!v)
+		return NULL;
+	return sdbfs_record(it, v);
 }
 
-int sdbfs_open_name(struct sdbfs *fs, const char *name)
+/* The device's own iterator, used by the simple (non-reentrant) API */
+static struct sdbfs_iter *sdbfs_own_iter(struct sdbfs *fs)
 {
-	struct sdb_device *d;
-	int len = strlen(name);
+	struct sdbfs_iter *it = &fs->it;
+
+	it->fs = fs;
+#ifndef SDBFS_MINIMAL
+	it->tblbuf = fs->tblbuf;
+	it->tblsize = fs->tblsize;
+	it->stack = fs->stack;
+	it->maxdepth = fs->maxdepth;
+#endif
+	return it;
+}
 
-	if (len > 19)
-		return -ENOENT;
-	sdbfs_scan(fs, 1); /* new scan: get the interconnect and igore it */
-	while ( (d = sdbfs_scan(fs, 0)) != NULL) {
-		if (strncmp(name, d->sdb_component.product.name, len))
-			continue;
-		if (len < 19 && d->sdb_component.product.name[len] != ' ')
-			continue;
-		fs->currentp = d;
-		__open(fs);
+struct sdb_device *sdbfs_scan(struct sdbfs *fs, int newscan)
+{
+	if (newscan)
+		sdbfs_own_iter(fs);
+	return sdbfs_iter_scan(&fs->it, newscan);
+}
+
+static void __open(struct sdbfs_file *f, struct sdbfs *fs,
+		   const struct sdb_device *d, sdbfs_off_t base, int bus)
+{
+	f->record = *d;
+	f->bus = bus;
+	f->f_offset = base + ntohll(d->sdb_component.addr_first);
+	f->f_len = ntohll(d->sdb_component.addr_last)
+		+ 1 - ntohll(d->sdb_component.addr_first);
+	f->read_offset = 0;
+	f->fs = fs;
+}
+
+#ifndef SDBFS_MINIMAL
+/*
+ * Names are blank-filled: "name" matches "name   " but not "names  ".
+ * The record is raw if "convert" is set, or already converted.
+ */
+static int sdbfs_name_match(const struct sdb_device *v, int convert,
+			    const char *name, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		if (__sdbfs_get8(v, SDBFS_VIEW_NAME + i, convert) != name[i])
+			return 0;
+	if (len < 19 && __sdbfs_get8(v, SDBFS_VIEW_NAME + len, convert) != ' ')
 		return 0;
+	return 1;
+}
+
+/*
+ * The index: names are hashed up to the first blank (so all names
+ * that may match according to the function above share the bucket),
+ * and the identifiers are hashed as they are stored (big-endian).
+ */
+static uint32_t sdbfs_hash_name(const char *name, int len)
+{
+	uint32_t h = 2166136261U; /* FNV-1a */
+	int i;
+
+	for (i = 0; i < len && name[i] != ' '; i++) {
+		h ^= (uint8_t)name[i];
+		h *= 16777619U;
 	}
-	return -ENOENT;
+	return h;
 }
 
-int sdbfs_open_id(struct sdbfs *fs, uint64_t vid, uint32_t did)
+static uint32_t sdbfs_hash_id(uint64_t vid, uint32_t did)
 {
-	struct sdb_device *d;
+	uint64_t h = (vid ^ did) * 0x9e3779b97f4a7c15ULL;
+
+	return h >> 32;
+}
+
+/*
+ * Address ranges are sorted by start and, if equal, larger first, so a
+ * bridge comes before what it contains. Tables are mostly in address
+ * order already, so insertion sort is almost linear here.
+ */
+static void sdbfs_sort_ranges(struct sdbfs_irange *r, int n)
+{
+	struct sdbfs_irange tmp;
+	int i, j;
+
+	for (i = 1; i < n; i++) {
+		tmp = r[i];
+		for (j = i; j > 0; j--) {
+			if (r[j - 1].first < tmp.first)
+				break;
+			if (r[j - 1].first == tmp.first
+			    && r[j - 1].last >= tmp.last)
+				break;
+			r[j] = r[j - 1];
+		}
+		r[j] = tmp;
+	}
+}
+
+/* Collect devices and bridges, sort them, link each to its container */
+static struct sdbfs_irange *sdbfs_index_ranges(struct sdbfs_index *idx,
+					       unsigned long end)
+{
+	struct sdbfs_ientry *e = idx->entries;
+	struct sdbfs_irange *r = (void *)(e + idx->nentries);
+	struct sdb_component *c;
+	int i, n, top;
+
+	for (i = n = 0; i < idx->nentries; i++) {
+		c = &e[i].record.sdb_component;
+		if (c->product.record_type != sdb_type_device
+		    && c->product.record_type != sdb_type_bridge)
+			continue;
+		if ((unsigned long)(r + n + 1) > end)
+			return NULL;
+		r[n].first = e[i].base + ntohll(c->addr_first);
+		r[n].last = e[i].base + ntohll(c->addr_last);
+		r[n].entry = e + i;
+		n++;
+	}
+	sdbfs_sort_ranges(r, n);
+
+	/* The chain of "up" links is the stack of open ranges */
+	for (i = 0, top = -1; i < n; i++) {
+		while (top >= 0 && r[top].last < r[i].first)
+			top = r[top].up;
+		r[i].up = top;
+		top = i;
+	}
+	idx->ranges = r;
+	idx->nranges = n;
+	return r + n;
+}
 
-	sdbfs_scan(fs, 1); /* new scan: get the interconnect and igore it */
+int sdbfs_index_build(struct sdbfs *fs, void *arena, unsigned long size)
+{
+	struct sdbfs_index *idx;
+	struct sdbfs_ientry *e;
+	struct sdbfs_irange *r;
+	struct sdb_device *d;
+	unsigned long p, end;
+	int i, n, nb, h;
+
+	fs->index = NULL; /* we must scan the device, not the old index */
+	p = ((unsigned long)arena + 7) & ~7UL;
+	end = (unsigned long)arena + size;
+	idx = (void *)p;
+	e = (void *)((p + sizeof(*idx) + 7) & ~7UL);
+
+	/* copy all records, but the toplevel interconnect (like open does) */
+	n = 0;
+	sdbfs_scan(fs, 1);
 	while ( (d = sdbfs_scan(fs, 0)) != NULL) {
-		if (vid != d->sdb_component.product.vendor_id)
+		if ((unsigned long)(e + n + 1) > end)
+			return -ENOMEM;
+		e[n].record = *d; /* converted, so lookups need not convert */
+		e[n].base = sdbfs_iter_base(&fs->it);
+		e[n].bus = fs->it.lv[fs->it.depth].bus;
+		n++;
+	}
+	if (fs->it.err)
+		return fs->it.err; /* an incomplete index would lie */
+	idx->nentries = n;
+	idx->entries = e;
+	r = sdbfs_index_ranges(idx, end);
+	if (!r)
+		return -ENOMEM;
+
+	/* Buckets: as many as the entries (a power of two) if room allows */
+	p = ((unsigned long)r + 7) & ~7UL;
+	for (nb = 1; nb < n && p + 4 * nb * sizeof(int) <= end; nb <<= 1)
+		;
+	if (p + 2 * nb * sizeof(int) > end)
+		return -ENOMEM;
+	idx->nbuckets = nb;
+	idx->name_bucket = (int *)p;
+	idx->id_bucket = idx->name_bucket + nb;
+	for (i = 0; i < nb; i++)
+		idx->name_bucket[i] = idx->id_bucket[i] = -1;
+
+	/* Insert backwards, so the first record found by scanning wins */
+	for (i = n - 1; i >= 0; i--) {
+		d = &e[i].record;
+		h = sdbfs_hash_name((char *)d->sdb_component.product.name, 19)
+			& (nb - 1);
+		e[i].next_name = idx->name_bucket[h];
+		idx->name_bucket[h] = i;
+		h = sdbfs_hash_id(d->sdb_component.product.vendor_id,
+				  d->sdb_component.product.device_id)
+			& (nb - 1);
+		e[i].next_id = idx->id_bucket[h];
+		idx->id_bucket[h] = i;
+	}
+	fs->index = idx;
+	return 0;
+}
+
+/* The innermost device or bridge that includes "addr" (needs the index) */
+struct sdbfs_irange *sdbfs_find_addr(struct sdbfs *fs, sdbfs_off_t addr)
+{
+	struct sdbfs_index *idx = fs->index;
+	struct sdbfs_irange *r;
+	int lo, hi, mid;
+
+	if (!idx)
+		return NULL;
+	r = idx->ranges;
+	/* Find the last range starting at or before addr... */
+	for (lo = 0, hi = idx->nranges; lo < hi; ) {
+		mid = (lo + hi) / 2;
+		if (r[mid].first <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	/* ...then it, or one of the ranges enclosing it, is the one */
+	for (mid = lo - 1; mid >= 0; mid = r[mid].up)
+		if (addr <= r[mid].last)
+			return r + mid;
+	return NULL;
+}
+
+static struct sdbfs_ientry *sdbfs_index_name(struct sdbfs_index *idx,
+					     const char *name, int len)
+{
+	struct sdbfs_ientry *e;
+	int i;
+
+	i = idx->name_bucket[sdbfs_hash_name(name, len) & (idx->nbuckets - 1)];
+	for (; i >= 0; i = e->next_name) {
+		e = idx->entries + i;
+		if (sdbfs_name_match(&e->record, 0, name, len))
+			return e;
+	}
+	return NULL;
+}
+
+static struct sdbfs_ientry *sdbfs_index_id(struct sdbfs_index *idx,
+					   uint64_t vid, uint32_t did)
+{
+	struct sdbfs_ientry *e;
+	int i;
+
+	i = idx->id_bucket[sdbfs_hash_id(vid, did) & (idx->nbuckets - 1)];
+	for (; i >= 0; i = e->next_id) {
+		e = idx->entries + i;
+		if (vid == e->record.sdb_component.product.vendor_id
+		    && did == e->record.sdb_component.product.device_id)
+			return e;
+	}
+	return NULL;
+}
+#endif /* SDBFS_MINIMAL */
+
+static int __open_id(struct sdbfs_file *f, struct sdbfs_iter *it,
+		     uint64_t vid, uint32_t did)
+{
+	struct sdbfs *fs = it->fs;
+	const struct sdb_device *v;
+#ifndef SDBFS_MINIMAL
+	struct sdbfs_ientry *e;
+
+	if (fs->index) {
+		e = sdbfs_index_id(fs->index, vid, did);
+		if (!e)
+			return -ENOENT;
+		__open(f, fs, &e->record, e->base, e->bus);
+		return 0;
+	}
+#endif
+	/* vid and did are big-endian, the accessors return host order */
+	vid = ntohll(vid);
+	did = ntohl(did);
+	sdbfs_iter_view(it, 1); /* new scan: get the interconnect and igore it */
+	while ( (v = sdbfs_iter_view(it, 0)) != NULL) {
+		if (vid != sdbfs_view_vendor(fs, v))
 			continue;
-		if (did != d->sdb_component.product.device_id)
+		if (did != sdbfs_view_device(fs, v))
 			continue;
-		fs->currentp = d;
-		__open(fs);
+		__open(f, fs, sdbfs_record(it, v), sdbfs_iter_base(it),
+		       it->lv[it->depth].bus);
 		return 0;
 	}
-	return -ENOENT;
+	return it->err ? it->err : -ENOENT; /* maybe it is too deep */
+}
+
+int sdbfs_open_id(struct sdbfs *fs, uint64_t vid, uint32_t did)
+{
+	return __open_id(&fs->file, sdbfs_own_iter(fs), vid, did);
 }
 
 int sdbfs_close(struct sdbfs *fs)
 {
-	fs->currentp = NULL;
+	return sdbfs_file_close(&fs->file);
+}
+
+/*
+ * The reentrant flavour: the file is a caller's object, and we scan
+ * with a private iterator (so with no table buffer and SDBFS_DEPTH
+ * levels), or the caller's one. Any number of files can be open at
+ * the same time, by different threads.
+ */
+int sdbfs_iter_open_id(struct sdbfs_file *f, struct sdbfs_iter *it,
+		       uint64_t vid, uint32_t did)
+{
+	return __open_id(f, it, vid, did);
+}
+
+int sdbfs_file_open_id(struct sdbfs_file *f, struct sdbfs *fs,
+		       uint64_t vid, uint32_t did)
+{
+	struct sdbfs_iter it;
+
+	memset(&it, 0, sizeof(it));
+	it.fs = fs;
+	return __open_id(f, &it, vid, did);
+}
+
+/* Closing a file writes out what is in the write cache, if any */
+int sdbfs_file_close(struct sdbfs_file *f)
+{
+#ifndef SDBFS_MINIMAL
+	struct sdbfs *fs = f->fs;
+
+	f->fs = NULL;
+	if (fs && fs->wcache)
+		return sdbfs_flush(fs);
+#else
+	f->fs = NULL;
+#endif
 	return 0;
 }
 
 /* to "find" a device, open it, get the current offset, then close */
-unsigned long sdbfs_find_name(struct sdbfs *fs, const char *name)
+sdbfs_off_t sdbfs_find_id(struct sdbfs *fs, uint64_t vid, uint32_t did)
 {
-	unsigned long offset;
+	sdbfs_off_t offset;
 	int ret;
 
-	ret = sdbfs_open_name(fs, name);
+	ret = sdbfs_open_id(fs, vid, did);
 	if (ret < 0)
-		return (unsigned long)ret;
+		return (sdbfs_off_t)ret;
 
-	offset = fs->f_offset;
+	offset = fs->file.f_offset;
 	sdbfs_close(fs);
 	return offset;
 }
 
-unsigned long sdbfs_find_id(struct sdbfs *fs, uint64_t vid, uint32_t did)
+/* Lookup by name or by path, and walking: not in the minimal profile */
+#ifndef SDBFS_MINIMAL
+static int __open_name(struct sdbfs_file *f, struct sdbfs_iter *it,
+		       const char *name)
+{
+	struct sdbfs *fs = it->fs;
+	const struct sdb_device *v;
+	struct sdbfs_ientry *e;
+	int len = strlen(name);
+
+	if (len > 19)
+		return -ENOENT;
+	if (fs->index) {
+		e = sdbfs_index_name(fs->index, name, len);
+		if (!e)
+			return -ENOENT;
+		__open(f, fs, &e->record, e->base, e->bus);
+		return 0;
+	}
+	sdbfs_iter_view(it, 1); /* new scan: get the interconnect and igore it */
+	while ( (v = sdbfs_iter_view(it, 0)) != NULL) {
+		if (!sdbfs_name_match(v, sdbfs_convert32(fs), name, len))
+			continue;
+		__open(f, fs, sdbfs_record(it, v), sdbfs_iter_base(it),
+		       it->lv[it->depth].bus);
+		return 0;
+	}
+	return it->err ? it->err : -ENOENT; /* maybe it is too deep */
+}
+
+/*
+ * Open by path: one component per level, only entering the bridge
+ * whose name matches. A single scan level is used, so any depth works.
+ */
+static int __open_path(struct sdbfs_file *f, struct sdbfs_iter *it,
+		       const char *path)
+{
+	struct sdbfs *fs = it->fs;
+	struct sdbfs_level *l = it->levels;
+	const struct sdb_device *v;
+	const char *next;
+	int len;
+
+	it->lv = l;
+	it->nlevels = 1;
+	it->err = 0;
+	l->base = 0;
+	l->this = fs->entrypoint;
+	if (!scan_newdir(it, 0))
+		return -ENOENT;
+	while (*path == '/')
+		path++;
+	for (;;) {
+		for (len = 0; path[len] && path[len] != '/'; len++)
+			;
+		for (next = path + len; *next == '/'; next++)
+			;
+		if (!len || len > 19)
+			return -ENOENT;
+		for (v = NULL; l->nleft; v = NULL) {
+			v = it->currentp = sdbfs_readentry(it, l->this, 0);
+			l->this += sizeof(*v);
+			l->nleft--;
+			if (sdbfs_name_match(v, sdbfs_convert32(fs), path, len))
+				break;
+		}
+		if (!v)
+			return -ENOENT;
+		if (!*next) {
+			__open(f, fs, sdbfs_record(it, v), l->base, l->bus);
+			return 0;
+		}
+		if (sdbfs_view_type(fs, v) != sdb_type_bridge)
+			return -ENOTDIR;
+		l->this = l->base + sdbfs_view_child(fs, v);
+		l->base = l->base + sdbfs_view_first(fs, v);
+		if (!scan_newdir(it, 0))
+			return -ENOENT;
+		path = next;
+	}
+}
+
+int sdbfs_open_name(struct sdbfs *fs, const char *name)
+{
+	return __open_name(&fs->file, sdbfs_own_iter(fs), name);
+}
+
+int sdbfs_open_path(struct sdbfs *fs, const char *path)
+{
+	return __open_path(&fs->file, sdbfs_own_iter(fs), path);
+}
+
+int sdbfs_iter_open_name(struct sdbfs_file *f, struct sdbfs_iter *it,
+			 const char *name)
+{
+	return __open_name(f, it, name);
+}
+
+int sdbfs_file_open_name(struct sdbfs_file *f, struct sdbfs *fs,
+			 const char *name)
+{
+	struct sdbfs_iter it;
+
+	memset(&it, 0, sizeof(it));
+	it.fs = fs;
+	return __open_name(f, &it, name);
+}
+
+int sdbfs_file_open_path(struct sdbfs_file *f, struct sdbfs *fs,
+			 const char *path)
+{
+	struct sdbfs_iter it;
+
+	memset(&it, 0, sizeof(it));
+	it.fs = fs;
+	return __open_path(f, &it, path);
+}
+
+/*
+ * The digest of a file lives in the table of its own directory. Like
+ * __open_path, use a single level: only enter the bridge that includes
+ * the file, so the lookup needs no stack.
+ */
+static int __digest(struct sdbfs_file *f, struct sdbfs_iter *it,
+		    struct sdbfs_digest *d)
+{
+	struct sdbfs *fs = it->fs;
+	struct sdbfs_level *l = it->levels;
+	const struct sdb_device *v;
+	sdbfs_off_t first;
+	int type;
+
+	it->lv = l;
+	it->nlevels = 1;
+	it->err = 0;
+	l->base = 0;
+	l->this = fs->entrypoint;
+	if (!scan_newdir(it, 0))
+		return -ENOENT;
+	while (l->nleft) {
+		v = it->currentp = sdbfs_readentry(it, l->this, 0);
+		l->this += sizeof(*v);
+		l->nleft--;
+		type = sdbfs_view_type(fs, v);
+		first = l->base + sdbfs_view_first(fs, v);
+		if (type == SDBFS_TYPE_DIGEST && first == f->f_offset) {
+			memcpy(d, sdbfs_record(it, v), sizeof(*d));
+			return 0;
+		}
+		if (type != sdb_type_bridge || f->f_offset < first
+		    || f->f_offset > l->base + sdbfs_view_last(fs, v))
+			continue;
+		l->this = l->base + sdbfs_view_child(fs, v);
+		l->base = first;
+		if (!scan_newdir(it, 0))
+			return -ENOENT;
+	}
+	return -ENOENT;
+}
+
+int sdbfs_fdigest(struct sdbfs *fs, struct sdbfs_digest *d)
 {
-	unsigned long offset;
+	return sdbfs_file_digest(&fs->file, d);
+}
+
+int sdbfs_file_digest(struct sdbfs_file *f, struct sdbfs_digest *d)
+{
+	struct sdbfs_iter it;
+
+	if (!f->fs)
+		return -ENOENT;
+	memset(&it, 0, sizeof(it));
+	it.fs = f->fs;
+	return __digest(f, &it, d);
+}
+
+sdbfs_off_t sdbfs_find_name(struct sdbfs *fs, const char *name)
+{
+	sdbfs_off_t offset;
 	int ret;
 
-	ret = sdbfs_open_id(fs, vid, did);
+	ret = sdbfs_open_name(fs, name);
 	if (ret < 0)
-		return (unsigned long)ret;
+		return (sdbfs_off_t)ret;
 
-	offset = fs->f_offset;
+	offset = fs->file.f_offset;
 	sdbfs_close(fs);
 	return offset;
 }
+
+/* Don't enter the bridge just returned: the next record is a sibling */
+void sdbfs_iter_skip(struct sdbfs_iter *it)
+{
+	it->skip = 1;
+}
+
+/*
+ * The walker calls back for each record, with the base address of its
+ * directory. The callback returns one of SDBFS_WALK_*, or an error.
+ * Tables of skipped subtrees are never read.
+ */
+int sdbfs_iter_walk(struct sdbfs_iter *it,
+		    int (*cb)(struct sdbfs *fs, struct sdb_device *d,
+			      int depth, sdbfs_off_t base, void *arg),
+		    void *arg)
+{
+	struct sdb_device *d;
+	int ret, new = 1;
+
+	while ( (d = sdbfs_iter_scan(it, new)) != NULL) {
+		new = 0;
+		ret = cb(it->fs, d, it->depth, sdbfs_iter_base(it), arg);
+		if (ret < 0 || ret == SDBFS_WALK_STOP)
+			return ret;
+		if (ret == SDBFS_WALK_SKIP)
+			sdbfs_iter_skip(it);
+	}
+	return it->err;
+}
+
+int sdbfs_walk(struct sdbfs *fs,
+	       int (*cb)(struct sdbfs *fs, struct sdb_device *d,
+			 int depth, sdbfs_off_t base, void *arg),
+	       void *arg)
+{
+	return sdbfs_iter_walk(sdbfs_own_iter(fs), cb, arg);
+}
+#endif /* SDBFS_MINIMAL */
@@ -9,11 +9,25 @@
 #define SDB_USER	0
 #define SDB_FREESTAND	1
 
-#ifdef SDBFS_BIG_ENDIAN
+/* No threads here, as far as we know: locks are empty */
+typedef int sdbfs_lock_t;
+#define SDBFS_DEFINE_LOCK(name)	static int name __attribute__((unused))
+#define sdbfs_lock_init(l)	do {} while (0)
+#define sdbfs_lock(l)		do {} while (0)
+#define sdbfs_unlock(l)		do {} while (0)
+
+/* The Makefile tells us the endianness (see check-endian) */
+#if defined(SDBFS_BIG_ENDIAN)
 #  define ntohs(x) (x)
 #  define htons(x) (x)
 #  define ntohl(x) (x)
 #  define htonl(x) (x)
+#elif defined(SDBFS_LITTLE_ENDIAN)
+/* The builtins become one instruction, or a few shifts, at worst */
+#  define ntohs(x) __builtin_bswap16(x)
+#  define htons(x) __builtin_bswap16(x)
+#  define ntohl(x) __builtin_bswap32(x)
+#  define htonl(x) __builtin_bswap32(x)
 #else
-#  error "No support, yet, for little-endian freestanding library"
+#  error "Please define SDBFS_BIG_ENDIAN or SDBFS_LITTLE_ENDIAN"
 #endif
@@ -33,3 +33,18 @@
 #define SDB_FREESTAND	0
 
 #define sdb_print(format, ...) printk(format, __VA_ARGS__)
+
+#ifdef __BAREBOX__ /* single-threaded */
+typedef int sdbfs_lock_t;
+#  define SDBFS_DEFINE_LOCK(name)	static int name __attribute__((unused))
+#  define sdbfs_lock_init(l)		do {} while (0)
+#  define sdbfs_lock(l)			do {} while (0)
+#  define sdbfs_unlock(l)		do {} while (0)
+#else
+#  include <linux/mutex.h>
+typedef struct mutex sdbfs_lock_t;
+#  define SDBFS_DEFINE_LOCK(name)	static DEFINE_MUTEX(name)
+#  define sdbfs_lock_init(l)		mutex_init(l)
+#  define sdbfs_lock(l)			mutex_lock(l)
+#  define sdbfs_unlock(l)		mutex_unlock(l)
+#endif
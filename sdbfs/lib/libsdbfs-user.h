@@ -5,6 +5,7 @@
 #include <string.h>
 #include <errno.h>
 #include <arpa/inet.h> /* htonl */
+#include <pthread.h>
 
 #define SDB_KERNEL	0
 #define SDB_USER	1
@@ -12,4 +13,11 @@
 
 #define sdb_print(format, ...) fprintf(stderr, format, __VA_ARGS__)
 
+typedef pthread_mutex_t sdbfs_lock_t;
+#define SDBFS_DEFINE_LOCK(name)	static sdbfs_lock_t name = \
+					PTHREAD_MUTEX_INITIALIZER
+#define sdbfs_lock_init(l)	pthread_mutex_init(l, NULL)
+#define sdbfs_lock(l)		pthread_mutex_lock(l)
+#define sdbfs_unlock(l)		pthread_mutex_unlock(l)
+
 #endif /* __LIBSDBFS_USER_H__ */
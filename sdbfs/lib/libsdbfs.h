@@ -12,7 +12,141 @@
 
 #include <sdb.h> /* Please point your "-I" to some sensible place */
 
-#define SDBFS_DEPTH 4 /* Max number of subdirectory depth */
+/*
+ * The minimal profile is for tiny processors: read-only access by id,
+ * no caches, no index, no table buffer, 32-bit offsets and one level.
+ * Users must define SDBFS_MINIMAL too, as structures are smaller.
+ * Otherwise offsets (sdbfs_off_t) and sizes are 64 bits, like in SDB;
+ * sdbfs_ssize_t is used for counts, return values and file offsets
+ * where a negative value means "the current position".
+ */
+#ifdef SDBFS_MINIMAL
+#  ifndef SDBFS_NO_CONVERT32
+#    define SDBFS_NO_CONVERT32
+#  endif
+#  ifndef SDBFS_DEPTH
+#    define SDBFS_DEPTH 1
+#  endif
+typedef uint32_t sdbfs_off_t;
+typedef int32_t sdbfs_ssize_t;
+#else
+typedef uint64_t sdbfs_off_t;
+typedef int64_t sdbfs_ssize_t;
+#endif
+
+/*
+ * Word-swapped storage can only be found on little-endian hosts. Other
+ * builds can define SDBFS_NO_CONVERT32 if their storage is byte-addressed.
+ * In both cases swapping is compiled out and such images are refused.
+ */
+#if defined(SDBFS_BIG_ENDIAN) || defined(SDBFS_NO_CONVERT32)
+#  define SDBFS_CAN_CONVERT32	0
+#else
+#  define SDBFS_CAN_CONVERT32	1
+#endif
+
+#ifndef SDBFS_DEPTH
+#define SDBFS_DEPTH 4 /* Subdirectory depth, unless the caller has a stack */
+#endif
+#ifndef SDBFS_IOV_BATCH
+#define SDBFS_IOV_BATCH 16 /* Ranges passed to fs->readv in one call */
+#endif
+#ifndef SDBFS_VERIFY_CHUNK
+#define SDBFS_VERIFY_CHUNK 1024 /* Stack buffer for unmapped verification */
+#endif
+
+/* Ranges for vectored reads: offset is within the file, or absolute */
+struct sdbfs_iovec {
+	sdbfs_off_t offset;
+	void *buf;
+	sdbfs_ssize_t count;
+};
+
+/*
+ * An asynchronous read: the driver starts it in read_async and calls
+ * sdbfs_aio_complete() when done, possibly from interrupt context.
+ */
+struct sdbfs_aio {
+	/* public: set by the caller */
+	void (*done)(struct sdbfs_aio *aio);	/* may be null */
+	void *priv;
+	/* public: set by the library */
+	struct sdbfs *fs;
+	sdbfs_off_t offset;			/* absolute */
+	void *buf;
+	sdbfs_ssize_t count;
+	sdbfs_ssize_t ret;		/* when done: bytes or -errno */
+	volatile int busy;		/* cleared last, with release */
+};
+
+/*
+ * A metadata record of our own, not in the SDB specification: the
+ * digest of the leading "length" bytes of the file at "addr_first"
+ * (as in the file's record) in the same directory. Other readers
+ * ignore it, because bit 7 of the type is set. Big-endian, like <sdb.h>
+ */
+#define SDBFS_TYPE_DIGEST	0x83
+#define SDBFS_DIGEST_CRC32C	1
+
+struct sdbfs_digest {
+	uint32_t	algo;		/* 0x00-0x03 */
+	uint32_t	digest;		/* 0x04-0x07 */
+	uint64_t	addr_first;	/* 0x08-0x0f */
+	uint64_t	length;		/* 0x10-0x17 */
+	uint8_t		reserved[39];	/* 0x18-0x3e */
+	uint8_t		record_type;	/* 0x3f */
+};
+
+/*
+ * Delta patches, written by "gensdbfs -E" and applied by "sdb-read -p":
+ * the header, then each changed erase block as sdbfs_patch_block and
+ * its data. Checksums are sdbfs_crc32c(). Big-endian, like the rest.
+ */
+#define SDBFS_PATCH_MAGIC	0x53444264 /* "SDBd" */
+#define SDBFS_PATCH_ANYOLD	1 /* block was not all in the old image */
+
+struct sdbfs_patch {
+	uint32_t	magic;		/* 0x00-0x03 */
+	uint32_t	erase_size;	/* 0x04-0x07 */
+	uint64_t	image_size;	/* 0x08-0x0f, the new image */
+	uint32_t	image_crc;	/* 0x10-0x13, the new image */
+	uint32_t	nblocks;	/* 0x14-0x17 */
+};
+
+struct sdbfs_patch_block {
+	uint64_t	offset;		/* 0x00-0x07 */
+	uint32_t	length;		/* 0x08-0x0b, less at the end */
+	uint32_t	flags;		/* 0x0c-0x0f */
+	uint32_t	old_crc;	/* 0x10-0x13 */
+	uint32_t	new_crc;	/* 0x14-0x17 */
+};
+
+/*
+ * The optional index (see sdbfs_index_build) lives in memory provided
+ * by the caller. Each entry is a converted copy of a record, with the
+ * base address of its own directory, chained in two hash tables.
+ */
+struct sdbfs_ientry {
+	struct sdb_device record;
+	sdbfs_off_t base;
+	int bus;			/* sdb_bus_type of its directory */
+	int next_name, next_id;		/* -1 terminates the chain */
+};
+
+/* Devices and bridges, by absolute address, for sdbfs_find_addr() */
+struct sdbfs_irange {
+	sdbfs_off_t first, last;
+	struct sdbfs_ientry *entry;
+	int up;				/* enclosing range, or -1 */
+};
+
+struct sdbfs_index {
+	int nentries, nbuckets, nranges;
+	int *name_bucket, *id_bucket;
+	struct sdbfs_ientry *entries;
+	struct sdbfs_irange *ranges;	/* sorted by first, then size */
+};
+
 /*
  * Data structures: please not that the library intself doesn't use
  * malloc, so it's the caller who must deal withallocation/removal.
@@ -20,60 +154,290 @@
  * are private
  */
 
+/*
+ * The optional write cache (see sdbfs_wcache_init) lives in memory
+ * provided by the caller, too. Each slot hosts one erase block.
+ */
+struct sdbfs_wslot {
+	sdbfs_off_t addr;		/* of the block, if data is valid */
+	unsigned long lo, hi;		/* dirty range, none if lo == hi */
+	unsigned long stamp;		/* for LRU replacement */
+	int valid;
+	uint8_t *data;
+};
+
+struct sdbfs_wcache {
+	int nslots;
+	unsigned long stamp;
+	struct sdbfs_wslot *slots;
+};
+
+/* Memory needed for a write cache of n erase blocks */
+#define SDBFS_WCACHE_SIZE(n, blocksize) \
+	(sizeof(struct sdbfs_wcache) + 16 \
+	 + (n) * (sizeof(struct sdbfs_wslot) + (blocksize)))
+
+/*
+ * The optional read cache (see sdbfs_rcache_init): lines are allocated
+ * in LRU order, and sequential misses read ahead several contiguous
+ * lines in a single driver call. Statistics are there for the user.
+ */
+struct sdbfs_rline {
+	sdbfs_off_t addr;
+	unsigned long stamp;		/* for LRU replacement */
+	int valid;
+};
+
+struct sdbfs_rcache {
+	int nlines, last;		/* "last" is a hint for lookup */
+	unsigned long linesize;
+	unsigned long stamp;
+	sdbfs_off_t next;		/* expected by a sequential reader */
+	int ra;				/* read-ahead, in lines */
+	unsigned long hits, misses, reads;
+	struct sdbfs_rline *lines;
+	uint8_t *data;			/* nlines * linesize */
+};
+
+/* The state of a scan in one directory: an array of them is a stack */
+struct sdbfs_level {
+	sdbfs_off_t base;		/* for relative addresses */
+	sdbfs_off_t this;		/* current sdb record */
+	int nleft;
+	int bus;			/* from the interconnect record */
+#ifndef SDBFS_MINIMAL
+	void *table;			/* records, in tblbuf */
+	sdbfs_off_t tstart;		/* offset of table */
+	unsigned long tused;		/* tblbuf used up to here */
+#endif
+};
+
+/*
+ * A scan cursor. The device has its own one, used by sdbfs_scan() and
+ * by the simple open functions. Users who need concurrent scans can
+ * declare more: fill "fs" (and optionally the buffer), zero the rest.
+ * Without a stack, SDBFS_DEPTH levels are available; bridges deeper
+ * than that are not entered, and "err" is set to -E2BIG.
+ */
+struct sdbfs_iter {
+	struct sdbfs *fs;
+#ifndef SDBFS_MINIMAL
+	void *tblbuf;			/* same role as in struct sdbfs */
+	unsigned long tblsize;
+	struct sdbfs_level *stack;	/* same role as in struct sdbfs */
+	int maxdepth;
+#endif
+	int depth;			/* of the current record */
+	int err;			/* reset at each new scan */
+
+	/* The following fields are library-private */
+	const struct sdb_device *currentp;	/* raw */
+	struct sdb_device raw_record;		/* when read from device */
+#if SDBFS_CAN_CONVERT32
+	struct sdb_device current_record;	/* converted, if needed */
+#endif
+	struct sdbfs_level *lv;			/* stack or levels */
+	int nlevels;
+#ifndef SDBFS_MINIMAL
+	int skip;				/* don't enter this bridge */
+#endif
+	struct sdbfs_level levels[SDBFS_DEPTH];
+};
+
+/* The base address of the directory holding the current record */
+static inline sdbfs_off_t sdbfs_iter_base(struct sdbfs_iter *it)
+{
+	return it->lv[it->depth].base;
+}
+
+/*
+ * An open file. Again, the device has one for sdbfs_open_name() and
+ * friends, while the sdbfs_file_* functions act on the caller's ones.
+ * All fields are library-private; "fs" is NULL when the file is closed.
+ */
+struct sdbfs_file {
+	struct sdbfs *fs;
+	struct sdb_device record;	/* converted copy */
+	sdbfs_off_t f_len;
+	sdbfs_off_t f_offset;		/* start of file */
+	sdbfs_off_t read_offset;	/* current location */
+	int bus;			/* sdb_bus_type of its directory */
+};
+
 struct sdbfs {
 
 	/* Some fields are informative */
 	char *name;			/* may be null */
 	void *drvdata;			/* driver may need some detail.. */
+#ifndef SDBFS_MINIMAL
 	unsigned long blocksize;
-	unsigned long entrypoint;
+#endif
+	sdbfs_off_t entrypoint;
 	unsigned long flags;
 
 	/* The "driver" must offer some methods */
 	void *data;			/* Use this if directly mapped */
-	unsigned long datalen;		/* Length of the above array */
-	int (*read)(struct sdbfs *fs, int offset, void *buf, int count);
-	int (*write)(struct sdbfs *fs, int offset, void *buf, int count);
-	int (*erase)(struct sdbfs *fs, int offset, int count);
+	sdbfs_off_t datalen;		/* Length of the above array */
+	sdbfs_ssize_t (*read)(struct sdbfs *fs, sdbfs_off_t offset, void *buf,
+			      sdbfs_ssize_t count);
+#ifndef SDBFS_MINIMAL
+	sdbfs_ssize_t (*write)(struct sdbfs *fs, sdbfs_off_t offset, void *buf,
+			       sdbfs_ssize_t count);
+	int (*erase)(struct sdbfs *fs, sdbfs_off_t offset, sdbfs_off_t count);
+	/* Optional: "n" ranges with absolute offsets, sorted and merged */
+	sdbfs_ssize_t (*readv)(struct sdbfs *fs, struct sdbfs_iovec *iov,
+			       int n);
+	/* Optional: start a transfer; without read, reads are built on it */
+	int (*read_async)(struct sdbfs *fs, struct sdbfs_aio *aio);
+	void (*poll)(struct sdbfs *fs);	/* called while waiting */
+	/* Optional: single bus accesses, for sdbfs_fread_bus() */
+	int (*read8)(struct sdbfs *fs, sdbfs_off_t offset, uint8_t *val);
+	int (*read16)(struct sdbfs *fs, sdbfs_off_t offset, uint16_t *val);
+	int (*read32)(struct sdbfs *fs, sdbfs_off_t offset, uint32_t *val);
+	int (*read64)(struct sdbfs *fs, sdbfs_off_t offset, uint64_t *val);
+
+	/* If not mapped, whole directory tables are read here, if they fit */
+	void *tblbuf;
+	unsigned long tblsize;
+	/* Optional scan stack, for trees deeper than SDBFS_DEPTH */
+	struct sdbfs_level *stack;
+	int maxdepth;
+#endif
 
 	/* The following fields are library-private */
-	struct sdb_device *currentp;
-	struct sdb_device current_record;
-	unsigned long f_len;
-	unsigned long f_offset;		/* start of file */
-	unsigned long read_offset;	/* current location */
+	struct sdbfs_iter it;		/* for sdbfs_scan() */
+	struct sdbfs_file file;		/* for sdbfs_open_*() */
 	struct sdbfs *next;
-	/* The following ones are directory-aware */
-	unsigned long base[SDBFS_DEPTH];	/* for relative addresses */
-	unsigned long this[SDBFS_DEPTH];	/* current sdb record */
-	int nleft[SDBFS_DEPTH];
-	int depth;
+#ifndef SDBFS_MINIMAL
+	struct sdbfs_index *index;	/* may be null */
+	struct sdbfs_wcache *wcache;	/* may be null */
+	struct sdbfs_rcache *rcache;	/* may be null */
+	sdbfs_lock_t lock;		/* for the caches */
+#endif
 };
 
+/* Return values for the sdbfs_walk() callback (or a negative error) */
+#define SDBFS_WALK_DESCEND	0
+#define SDBFS_WALK_SKIP		1 /* don't enter this bridge */
+#define SDBFS_WALK_STOP		2
+
 /* Some flags are set by the user, some (convert32) by the library */
 #define SDBFS_F_VERBOSE		0x0001 /* not really used yet */
 #define SDBFS_F_CONVERT32	0x0002 /* swap SDB words as they are read */
 #define SDBFS_F_ZEROBASED	0x0004 /* zero is a valid data pointer */
 
+#define sdbfs_convert32(fs) \
+	(SDBFS_CAN_CONVERT32 && ((fs)->flags & SDBFS_F_CONVERT32))
+
 /* Defined in glue.c */
 int sdbfs_dev_create(struct sdbfs *fs);
 int sdbfs_dev_destroy(struct sdbfs *fs);
 struct sdbfs *sdbfs_dev_find(const char *name);
-unsigned long sdbfs_find_name(struct sdbfs *fs, const char *name);
-unsigned long sdbfs_find_id(struct sdbfs *fs, uint64_t vid, uint32_t did);
-int sdbfs_open_name(struct sdbfs *fs, const char *name);
+sdbfs_off_t sdbfs_find_id(struct sdbfs *fs, uint64_t vid, uint32_t did);
 int sdbfs_open_id(struct sdbfs *fs, uint64_t vid, uint32_t did);
 int sdbfs_close(struct sdbfs *fs);
 struct sdb_device *sdbfs_scan(struct sdbfs *fs, int newscan);
+struct sdb_device *sdbfs_iter_scan(struct sdbfs_iter *it, int newscan);
+const struct sdb_device *sdbfs_iter_view(struct sdbfs_iter *it, int newscan);
+int sdbfs_file_open_id(struct sdbfs_file *f, struct sdbfs *fs,
+		       uint64_t vid, uint32_t did);
+int sdbfs_iter_open_id(struct sdbfs_file *f, struct sdbfs_iter *it,
+		       uint64_t vid, uint32_t did);
+int sdbfs_file_close(struct sdbfs_file *f);
+#ifndef SDBFS_MINIMAL
+sdbfs_off_t sdbfs_find_name(struct sdbfs *fs, const char *name);
+int sdbfs_open_name(struct sdbfs *fs, const char *name);
+int sdbfs_open_path(struct sdbfs *fs, const char *path);
+int sdbfs_index_build(struct sdbfs *fs, void *arena, unsigned long size);
+int sdbfs_find_entry(struct sdbfs *fs);
+struct sdbfs_irange *sdbfs_find_addr(struct sdbfs *fs, sdbfs_off_t addr);
+int sdbfs_file_open_name(struct sdbfs_file *f, struct sdbfs *fs,
+			 const char *name);
+int sdbfs_iter_open_name(struct sdbfs_file *f, struct sdbfs_iter *it,
+			 const char *name);
+int sdbfs_file_open_path(struct sdbfs_file *f, struct sdbfs *fs,
+			 const char *path);
+int sdbfs_fdigest(struct sdbfs *fs, struct sdbfs_digest *d);
+int sdbfs_file_digest(struct sdbfs_file *f, struct sdbfs_digest *d);
+void sdbfs_iter_skip(struct sdbfs_iter *it);
+int sdbfs_iter_walk(struct sdbfs_iter *it,
+		    int (*cb)(struct sdbfs *fs, struct sdb_device *d,
+			      int depth, sdbfs_off_t base, void *arg),
+		    void *arg);
+int sdbfs_walk(struct sdbfs *fs,
+	       int (*cb)(struct sdbfs *fs, struct sdb_device *d,
+			 int depth, sdbfs_off_t base, void *arg),
+	       void *arg);
+#endif
 
 /* Defined in access.c */
 int sdbfs_fstat(struct sdbfs *fs, struct sdb_device *record_return);
-int sdbfs_fread(struct sdbfs *fs, int offset, void *buf, int count);
-int sdbfs_fwrite(struct sdbfs *fs, int offset, void *buf, int count);
+sdbfs_ssize_t sdbfs_fread(struct sdbfs *fs, sdbfs_ssize_t offset, void *buf,
+			  sdbfs_ssize_t count);
+int sdbfs_fmap(struct sdbfs *fs, const void **ptr, sdbfs_off_t *len);
+int sdbfs_file_stat(struct sdbfs_file *f, struct sdb_device *record_return);
+sdbfs_ssize_t sdbfs_file_read(struct sdbfs_file *f, sdbfs_ssize_t offset,
+			      void *buf, sdbfs_ssize_t count);
+int sdbfs_file_map(struct sdbfs_file *f, const void **ptr, sdbfs_off_t *len);
+#ifndef SDBFS_MINIMAL
+sdbfs_ssize_t sdbfs_fwrite(struct sdbfs *fs, sdbfs_ssize_t offset, void *buf,
+			   sdbfs_ssize_t count);
+sdbfs_ssize_t sdbfs_freadv(struct sdbfs *fs, struct sdbfs_iovec *iov, int n);
+sdbfs_ssize_t sdbfs_fread_bus(struct sdbfs *fs, sdbfs_ssize_t offset,
+			      void *buf, sdbfs_ssize_t count);
+int sdbfs_fread_async(struct sdbfs *fs, sdbfs_ssize_t offset, void *buf,
+		      sdbfs_ssize_t count, struct sdbfs_aio *aio);
+sdbfs_ssize_t sdbfs_file_write(struct sdbfs_file *f, sdbfs_ssize_t offset,
+			       void *buf, sdbfs_ssize_t count);
+sdbfs_ssize_t sdbfs_file_readv(struct sdbfs_file *f, struct sdbfs_iovec *iov,
+			       int n);
+sdbfs_ssize_t sdbfs_dev_readv(struct sdbfs *fs, struct sdbfs_iovec *iov,
+			      int n);
+sdbfs_ssize_t sdbfs_file_read_bus(struct sdbfs_file *f, sdbfs_ssize_t offset,
+				  void *buf, sdbfs_ssize_t count);
+int sdbfs_file_read_async(struct sdbfs_file *f, sdbfs_ssize_t offset,
+			  void *buf, sdbfs_ssize_t count,
+			  struct sdbfs_aio *aio);
+void sdbfs_aio_complete(struct sdbfs_aio *aio, sdbfs_ssize_t ret);
+sdbfs_ssize_t sdbfs_aio_wait(struct sdbfs_aio *aio);
+sdbfs_ssize_t sdbfs_aio_read(struct sdbfs *fs, sdbfs_off_t offset, void *buf,
+			     sdbfs_ssize_t count);
+
+/* Defined in cache.c */
+int sdbfs_wcache_init(struct sdbfs *fs, void *arena, unsigned long size);
+sdbfs_ssize_t sdbfs_wcache_write(struct sdbfs *fs, sdbfs_off_t offset,
+				 void *buf, sdbfs_ssize_t count);
+void sdbfs_wcache_patch(struct sdbfs *fs, sdbfs_off_t offset, void *buf,
+			sdbfs_ssize_t count);
+int sdbfs_flush(struct sdbfs *fs);
+int sdbfs_rcache_init(struct sdbfs *fs, void *arena, unsigned long size,
+		      unsigned long linesize);
+void sdbfs_rcache_invalidate(struct sdbfs *fs, sdbfs_off_t offset,
+			     sdbfs_off_t count);
+sdbfs_ssize_t sdbfs_dev_read(struct sdbfs *fs, sdbfs_off_t offset, void *buf,
+			     sdbfs_ssize_t count);
+
+/* Defined in digest.c */
+uint32_t sdbfs_crc32c(uint32_t crc, const void *buf, unsigned long len);
+int sdbfs_fverify(struct sdbfs *fs);
+int sdbfs_file_verify(struct sdbfs_file *f);
+#else
+static inline sdbfs_ssize_t sdbfs_dev_read(struct sdbfs *fs,
+					   sdbfs_off_t offset, void *buf,
+					   sdbfs_ssize_t count)
+{
+	return fs->read(fs, offset, buf, count);
+}
+#endif /* SDBFS_MINIMAL */
 
 /* This is needed to convert endianness. Hoping it is not defined elsewhere */
 static inline uint64_t htonll(uint64_t ll)
 {
+#if defined(SDBFS_BIG_ENDIAN)
+	return ll;
+#elif defined(SDBFS_LITTLE_ENDIAN) && defined(__GNUC__)
+	return __builtin_bswap64(ll);
+#else
         uint64_t res;
 
         if (htonl(1) == 1)
@@ -81,10 +445,112 @@ static inline uint64_t htonll(uint64_t ll)
         res = htonl(ll >> 32);
         res |= (uint64_t)(htonl((uint32_t)ll)) << 32;
         return res;
+#endif
 }
 static inline uint64_t ntohll(uint64_t ll)
 {
 	return htonll(ll);
 }
 
+/*
+ * Record views: a raw record (in mapped memory, in a table buffer
+ * or in an iterator) is read through these accessors, that convert
+ * only the field being read, to host byte order. With SDBFS_F_CONVERT32
+ * the words are swapped, so on the (little-endian) host they are native.
+ * Offsets are those listed in <sdb.h>.
+ */
+#define SDBFS_VIEW_NAME		0x2c
+
+static inline uint32_t __sdbfs_get32(const void *v, int off, int convert)
+{
+	uint32_t w = *(const uint32_t *)((const uint8_t *)v + off);
+
+	return convert ? w : ntohl(w);
+}
+
+static inline uint64_t __sdbfs_get64(const void *v, int off, int convert)
+{
+	return ((uint64_t)__sdbfs_get32(v, off, convert) << 32)
+		| __sdbfs_get32(v, off + 4, convert);
+}
+
+static inline uint16_t __sdbfs_get16(const void *v, int off, int convert)
+{
+	uint32_t w = __sdbfs_get32(v, off & ~3, convert);
+
+	return off & 2 ? w & 0xffff : w >> 16;
+}
+
+static inline uint8_t __sdbfs_get8(const void *v, int off, int convert)
+{
+	uint32_t w;
+
+	if (!convert)
+		return ((const uint8_t *)v)[off];
+	w = __sdbfs_get32(v, off & ~3, convert);
+	return w >> (24 - 8 * (off & 3));
+}
+
+#define __SDBFS_VIEW(name, bits, off) \
+static inline uint##bits##_t sdbfs_view_##name(struct sdbfs *fs, \
+					      const struct sdb_device *v) \
+{ \
+	return __sdbfs_get##bits(v, off, sdbfs_convert32(fs)); \
+}
+
+__SDBFS_VIEW(magic, 32, 0x00)		/* interconnect */
+__SDBFS_VIEW(records, 16, 0x04)		/* interconnect */
+__SDBFS_VIEW(bus_type, 8, 0x07)		/* interconnect */
+__SDBFS_VIEW(child, 64, 0x00)		/* bridge */
+__SDBFS_VIEW(bus_specific, 32, 0x04)	/* device */
+__SDBFS_VIEW(first, 64, 0x08)
+__SDBFS_VIEW(last, 64, 0x10)
+__SDBFS_VIEW(vendor, 64, 0x18)
+__SDBFS_VIEW(device, 32, 0x20)
+__SDBFS_VIEW(version, 32, 0x24)
+__SDBFS_VIEW(date, 32, 0x28)
+__SDBFS_VIEW(type, 8, 0x3f)
+
+/* The name is blank-filled, not terminated: "buf" must host 20 bytes */
+static inline char *sdbfs_view_name(struct sdbfs *fs,
+				    const struct sdb_device *v, char *buf)
+{
+	int i;
+
+	for (i = 0; i < 19; i++)
+		buf[i] = __sdbfs_get8(v, SDBFS_VIEW_NAME + i,
+				      sdbfs_convert32(fs));
+	buf[i] = '\0';
+	return buf;
+}
+
+/*
+ * Wishbone devices declare the access widths they accept (a mask of
+ * SDB_WB_ACCESS*) and their byte order. Other buses use the same bits
+ * for other purposes, so files in non-wishbone directories report 0.
+ */
+static inline int sdbfs_file_access(struct sdbfs_file *f)
+{
+	if (f->bus != sdb_wishbone)
+		return 0;
+	return ntohl(f->record.bus_specific) & SDB_WB_WIDTH_MASK;
+}
+
+static inline int sdbfs_file_little_endian(struct sdbfs_file *f)
+{
+	if (f->bus != sdb_wishbone)
+		return 0;
+	return !!(ntohl(f->record.bus_specific) & SDB_WB_LITTLE_ENDIAN);
+}
+
+static inline int sdbfs_faccess(struct sdbfs *fs)
+{
+	return sdbfs_file_access(&fs->file);
+}
+
+static inline int sdbfs_flittle_endian(struct sdbfs *fs)
+{
+	return sdbfs_file_little_endian(&fs->file);
+}
+
 #endif /* __LIBSDBFS_H__ */
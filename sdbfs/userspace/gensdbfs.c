@@ -8,6 +8,7 @@
  * by CERN, the European Institute for Nuclear Research.
  */
 
+#define _GNU_SOURCE /* for copy_file_range */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -16,11 +17,15 @@
 #include <getopt.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
 
 #include <sdb.h>
+#include "libsdbfs.h" /* for htonll and digests */
 #include "gensdbfs.h"
 
 /*
@@ -32,15 +37,24 @@
 
 /* Lazily, these are globals, pity me */
 static unsigned blocksize = 64;
-static unsigned long devsize = 0; /* unspecified */
-static unsigned long lastwritten = 0;
+static uint64_t devsize = 0; /* unspecified */
+static uint64_t lastwritten = 0;
+static int opt_digest;
+static int opt_jobs;
+static int opt_sparse;
+static int opt_update;
+static int opt_pack;
+static int incremental; /* with -u, if the manifest matches the image */
+static uint64_t opt_direct = 1 << 20; /* bigger files are not staged */
+static uint64_t opt_erase; /* with -E, compare by erase block */
+static char *opt_prev, *opt_patch, *opt_target;
 static char *prgname;
 
 static struct sdbf *prepare_dir(char *name, struct sdbf *parent);
 
-static inline unsigned long SDB_ALIGN(unsigned long x)
+static inline uint64_t SDB_ALIGN(uint64_t x)
 {
-	return (x + (blocksize - 1)) & ~(blocksize - 1);
+	return (x + (blocksize - 1)) & ~(uint64_t)(blocksize - 1);
 }
 
 static void __fill_product(struct sdb_product *p, char *name, time_t t,
@@ -191,18 +205,18 @@ static int parse_config_line(struct sdbf *tree, struct sdbf *current, int line,
 			d->bus_specific &= htonl(~SDB_DATA_WRITE);
 		return 0;
 	}
-	if (sscanf(t, "maxsize = %li", &int32) == 1) {
-		current->size = int32;
+	if (sscanf(t, "maxsize = %lli", &int64) == 1) {
+		current->size = int64;
 		return 0;
 	}
-	if (sscanf(t, "position = %li", &int32) == 1) {
+	if (sscanf(t, "position = %lli", &int64) == 1) {
 		if (tree->level != 0) {
 			fprintf(stderr, "%s: Can't set position in subdirs"
 			       " (file \"%s\")\n", prgname, current->fullname);
 			return 0;
 		}
 		current->userpos = 1;
-		current->ustart = int32;
+		current->ustart = int64;
 		return 0;
 	}
 
@@ -217,7 +231,7 @@ static struct sdbf *scan_inputdir(char *name, struct sdbf *parent, FILE **cfgf)
 	DIR *d;
 	struct dirent *de;
 	struct sdbf *tree;
-	int n, ret;
+	int i, n, ret;
 
 	/* first loop: count the entries */
 	d = opendir(name);
@@ -279,6 +293,11 @@ static struct sdbf *scan_inputdir(char *name, struct sdbf *parent, FILE **cfgf)
 	/* number or records in the interconnect */
 	tree->s_i.sdb_records = htons(n);
 
+	/* with -c, each regular file gets a digest at the end of the table */
+	for (i = 1; opt_digest && i < n; i++)
+		if (!tree[i].subdir)
+			tree->ndigests++;
+
 	return tree;
 }
 
@@ -304,9 +323,11 @@ static void dump_tree(struct sdbf *tree)
 	for (i = 0; i < n; i++, tree++) {
 		printf("%s: \"%s\" ino %li\n", tree->fullname, tree->de.d_name,
 		       (long)tree->de.d_ino);
-		printf("ustart %lx, rstart %lx, base %lx, size %lx (%lx)\n",
-		       tree->ustart, tree->rstart, tree->base, tree->size,
-		       tree->stbuf.st_size);
+		printf("ustart %llx, rstart %llx, base %llx, "
+		       "size %llx (%llx)\n",
+		       (long long)tree->ustart, (long long)tree->rstart,
+		       (long long)tree->base, (long long)tree->size,
+		       (long long)tree->stbuf.st_size);
 		dumpstruct(stdout, "sdb record", &tree->s_d,
 			   sizeof(tree->s_d));
 		printf("\n");
@@ -350,129 +371,1119 @@ static struct sdbf *scan_config(struct sdbf *tree, FILE *f)
 	return tree;
 }
 
-/* step 2: place the files in the storage area */
+/*
+ * With -u, a manifest is saved next to the image: layout, size, mtime
+ * and CRC32C of each entry. If it still describes the image (options,
+ * image size and mtime), the next run only rewrites what changed.
+ */
+static struct mentry *mentries;
+static int nmentries, rootlen;
+
+static inline char *relname(struct sdbf *f)
+{
+	return f->fullname + rootlen;
+}
+
+static int mentry_cmp(const void *a, const void *b)
+{
+	return strcmp(((struct mentry *)a)->path, ((struct mentry *)b)->path);
+}
+
+static void load_manifest(char *output)
+{
+	char s[PATH_MAX + 256];
+	unsigned long long v[6];
+	unsigned int crc;
+	struct mentry *m;
+	struct stat st;
+	FILE *f;
+	char kind;
+	int i, len;
+
+	snprintf(s, sizeof(s), "%s.manifest", output);
+	f = fopen(s, "r");
+	if (!f)
+		return;
+	if (!fgets(s, sizeof(s), f)
+	    || sscanf(s, "sdbfs-manifest 1 %llx %llx %llx %llx %llx %llx",
+		      v, v + 1, v + 2, v + 3, v + 4, v + 5) != 6
+	    || v[0] != blocksize || v[1] != devsize || v[2] != opt_digest)
+		goto out;
+	if (stat(output, &st) < 0 || st.st_size != v[3]
+	    || st.st_mtim.tv_sec != v[4] || st.st_mtim.tv_nsec != v[5])
+		goto out;
+	while (fgets(s, sizeof(s), f)) {
+		len = strlen(s);
+		if (len && s[len - 1] == '\n')
+			s[--len] = '\0';
+		if (!(nmentries & 63)) {
+			mentries = realloc(mentries, (nmentries + 64)
+					   * sizeof(*mentries));
+			if (!mentries) {
+				fprintf(stderr, "%s: out of memory\n", prgname);
+				exit(1);
+			}
+		}
+		m = memset(mentries + nmentries, 0, sizeof(*m));
+		if (sscanf(s, "%c %llx %llx %llx %llx %llx %llx %x %n", &kind,
+			   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &crc,
+			   &i) != 8)
+			continue;
+		m->path = strdup(s + i);
+		m->isdir = kind == 'd';
+		m->rstart = v[0];
+		m->first = v[1];
+		m->size = v[2];
+		m->filesize = v[3];
+		m->mtime_sec = v[4];
+		m->mtime_nsec = v[5];
+		m->crc = crc;
+		nmentries++;
+	}
+	qsort(mentries, nmentries, sizeof(*mentries), mentry_cmp);
+	incremental = 1;
+out:
+	fclose(f);
+}
+
+/* Match the new tree with the previous one: files that fit stay there */
+static void apply_manifest(struct sdbf *tree)
+{
+	int i, n = ntohs(tree->s_i.sdb_records);
+	struct mentry key, *m;
+	struct sdbf *f;
+
+	for (i = 1; i < n; i++) {
+		f = tree + i;
+		key.path = relname(f);
+		m = bsearch(&key, mentries, nmentries, sizeof(*m), mentry_cmp);
+		if (m && m->isdir == !!f->subdir) {
+			f->old = m;
+			/* directories are checked when allocated */
+			f->keep = !f->userpos
+				&& (f->subdir || f->size <= m->size);
+		}
+		if (f->subdir)
+			apply_manifest(f->subdir);
+	}
+}
+
+static void save_entries(FILE *mf, struct sdbf *tree)
+{
+	int i, n = ntohs(tree->s_i.sdb_records);
+	struct sdbf *f;
+	uint64_t first;
+
+	for (i = 1; i < n; i++) {
+		f = tree + i;
+		if (f->subdir)
+			first = f->subdir->base;
+		else if (f->userpos)
+			first = f->ustart;
+		else
+			first = tree->base + f->rstart;
+		fprintf(mf, "%c %llx %llx %llx %llx %llx %llx %x %s\n",
+			f->subdir ? 'd' : 'f', (long long)f->rstart,
+			(long long)first, (long long)f->size,
+			f->subdir ? 0LL : (long long)f->stbuf.st_size,
+			(long long)f->stbuf.st_mtim.tv_sec,
+			(long long)f->stbuf.st_mtim.tv_nsec, f->crc,
+			relname(f));
+		if (f->subdir)
+			save_entries(mf, f->subdir);
+	}
+}
+
+/* Called when the image is complete, as its size and mtime are saved */
+static int save_manifest(struct sdbf *tree, char *output, int out)
+{
+	char name[PATH_MAX], tmp[PATH_MAX];
+	struct stat st;
+	FILE *mf;
+
+	snprintf(name, sizeof(name), "%s.manifest", output);
+	snprintf(tmp, sizeof(tmp), "%s.manifest.new", output);
+	if (fstat(out, &st) < 0 || !(mf = fopen(tmp, "w")))
+		goto err;
+	fprintf(mf, "sdbfs-manifest 1 %x %llx %x %llx %llx %llx\n",
+		blocksize, (long long)devsize, opt_digest,
+		(long long)st.st_size, (long long)st.st_mtim.tv_sec,
+		(long long)st.st_mtim.tv_nsec);
+	save_entries(mf, tree);
+	if (fclose(mf) == 0 && rename(tmp, name) == 0)
+		return 0;
+	unlink(tmp);
+err:
+	fprintf(stderr, "%s: %s: %s\n", prgname, name, strerror(errno));
+	return -1;
+}
+
+/*
+ * step 2: place the files in the storage area. The table, entries with
+ * a user position and (with -u) entries that keep their previous place
+ * are pinned; the others go sequentially after the table, skipping the
+ * pinned ranges, or with -O they are packed in the holes (best fit).
+ */
+struct range {
+	uint64_t start, end; /* end is excluded */
+	struct sdbf *f;
+};
+
+#define PACK_ALIGN 8 /* for read-only files, with -O */
+
+static uint64_t pack_used, pack_free, pack_largest;
+static int pack_holes;
+
+static int range_cmp(const void *a, const void *b)
+{
+	const struct range *ra = a, *rb = b;
+
+	return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+static struct range *collides(struct range *r, int nr, uint64_t start,
+			      uint64_t end)
+{
+	for (; nr--; r++)
+		if (start < r->end && r->start < end)
+			return r;
+	return NULL;
+}
+
+/* The table first, then user positions, then previous places (-u) */
+static int pin_ranges(struct sdbf *tree, uint64_t tend, struct range *r)
+{
+	int i, nr = 1, n = ntohs(tree->s_i.sdb_records);
+	struct range *c;
+	struct sdbf *f;
+
+	r[0].start = tree->ustart;
+	r[0].end = tend;
+	r[0].f = tree;
+	for (i = 1; i < n; i++) {
+		f = tree + i;
+		if (!f->userpos || !f->size)
+			continue;
+		c = collides(r, nr, f->ustart, f->ustart + f->size);
+		if (c) {
+			fprintf(stderr, "%s: %s collides with %s\n", prgname,
+				f->fullname, c->f->fullname);
+			return -1;
+		}
+		r[nr].start = f->ustart;
+		r[nr].end = f->ustart + f->size;
+		r[nr++].f = f;
+	}
+	for (i = 1; i < n; i++) {
+		f = tree + i;
+		if (!f->keep)
+			continue;
+		if (collides(r, nr, f->old->rstart,
+			     f->old->rstart + f->old->size)) {
+			f->keep = 0; /* the table grew, or a user position */
+			continue;
+		}
+		r[nr].start = f->old->rstart;
+		r[nr].end = f->old->rstart + f->old->size;
+		r[nr++].f = f;
+	}
+	qsort(r, nr, sizeof(*r), range_cmp);
+	return nr;
+}
+
+static inline uint64_t pack_align(struct sdbf *f)
+{
+	if (f->subdir || (f->s_d.bus_specific & htonl(SDB_DATA_WRITE))
+	    || blocksize < PACK_ALIGN)
+		return blocksize;
+	return PACK_ALIGN;
+}
+
+/* Bigger alignment first, then bigger size, then by name */
+static int pack_cmp(const void *a, const void *b)
+{
+	struct sdbf *fa = *(struct sdbf **)a, *fb = *(struct sdbf **)b;
+
+	if (pack_align(fa) != pack_align(fb))
+		return pack_align(fa) > pack_align(fb) ? -1 : 1;
+	if (fa->size != fb->size)
+		return fa->size > fb->size ? -1 : 1;
+	return strcmp(fa->basename, fb->basename);
+}
+
+/* With -O: best fit in the holes left by pinned ranges, or at the end */
+static int pack_dir(struct sdbf *tree, uint64_t tend, struct range *r,
+		    int nr)
+{
+	int i, j, best, nh = 0, nf = 0, n = ntohs(tree->s_i.sdb_records);
+	uint64_t a, start, tail = tend, waste;
+	struct range *h;
+	struct sdbf **files, *f;
+
+	h = malloc((nr + n) * sizeof(*h));
+	files = malloc(n * sizeof(*files));
+	if (!h || !files) {
+		fprintf(stderr, "%s: out of memory\n", prgname);
+		return -1;
+	}
+	for (i = 0; i < nr; i++) {
+		if (r[i].start > tail)
+			h[nh++] = (struct range){tail, r[i].start, NULL};
+		if (r[i].end > tail)
+			tail = r[i].end;
+	}
+	for (i = 1; i < n; i++)
+		if (!tree[i].userpos && !tree[i].keep)
+			files[nf++] = tree + i;
+	qsort(files, nf, sizeof(*files), pack_cmp);
+
+	for (i = 0; i < nf; i++) {
+		f = files[i];
+		a = pack_align(f);
+		for (best = -1, j = 0; j < nh; j++) {
+			start = (h[j].start + a - 1) & ~(a - 1);
+			if (start + f->size > h[j].end)
+				continue;
+			if (best < 0 || h[j].end - h[j].start < waste) {
+				best = j;
+				waste = h[j].end - h[j].start;
+			}
+		}
+		if (best < 0) { /* at the end */
+			f->rstart = (tail + a - 1) & ~(a - 1);
+			if (f->rstart > tail)
+				h[nh++] = (struct range){tail, f->rstart, NULL};
+			tail = f->rstart + f->size;
+			continue;
+		}
+		/* split the hole: what is before, and what is after */
+		f->rstart = (h[best].start + a - 1) & ~(a - 1);
+		h[nh] = h[best];
+		h[nh].start = f->rstart + f->size;
+		h[best].end = f->rstart;
+		if (h[nh].start < h[nh].end)
+			nh++;
+	}
+	for (i = 1; i < n; i++)
+		if (!tree[i].subdir)
+			pack_used += tree[i].size;
+	for (j = 0; j < nh; j++) {
+		waste = h[j].end - h[j].start;
+		if (!waste)
+			continue;
+		pack_free += waste;
+		pack_holes++;
+		if (waste > pack_largest)
+			pack_largest = waste;
+	}
+	free(files);
+	free(h);
+	return 0;
+}
+
+/* Subdirectories are allocated before their parent: fix them later */
+static void set_base(struct sdbf *tree, uint64_t base)
+{
+	int i, n = ntohs(tree->s_i.sdb_records);
+
+	tree->base = base;
+	for (i = 1; i < n; i++)
+		if (tree[i].subdir)
+			set_base(tree[i].subdir, base + tree[i].rstart);
+}
+
 static struct sdbf *alloc_storage(struct sdbf *tree)
 {
-	int i, n;
-	unsigned long subsize;
-	unsigned long rpos; /* the next expected relative position */
-	unsigned long l, last; /* keep track of last, for directory record */
-	struct sdbf *f, *sub;
+	int i, n, nr;
+	uint64_t rpos; /* the next expected relative position */
+	uint64_t l, last; /* keep track of last, for directory record */
+	struct range *r, *c;
+	struct sdbf *f;
 
 	/* The managed space starts at zero, even if the directory is later */
 	tree->s_i.sdb_component.addr_first = htonll(0);
 	/* The "suggested" output place is after the directory itself */
 	n = ntohs(tree->s_i.sdb_records);
-	rpos = tree->ustart + SDB_ALIGN(n * sizeof(struct sdb_device));
+	rpos = tree->ustart
+		+ SDB_ALIGN((n + tree->ndigests) * sizeof(struct sdb_device));
 	last = rpos;
 
+	/* Directories first, as their size depends on what's inside */
 	for (i = 1; i < n; i++) {
 		f = tree + i;
-
-		/* If a directory, make it allocate itself */
-		if (f->subdir) {
-			f->subdir->base = tree->base + rpos;
-			sub = alloc_storage(f->subdir);
-			if (!sub) {
-				fprintf(stderr, "%s: Error allocating %s\n",
-					prgname, f->fullname);
-				return NULL;
-			}
-			/* this size may have been set by the user */
-			subsize = ntohll(sub->s_i.sdb_component.addr_last);
-			if (subsize > f->size)
-				f->size = subsize;
-			f->s_b.sdb_child = htonll(rpos);
-		}
-
-		if (f->userpos) { /* user-specified position (level 0) */
-			f->s_d.sdb_component.addr_first = htonll(f->ustart);
-			l = f->ustart + f->size - 1;
-			f->s_d.sdb_component.addr_last = htonll(l);
-			if (l > last) last = l;
+		if (!f->subdir)
 			continue;
+		if (!alloc_storage(f->subdir)) {
+			fprintf(stderr, "%s: Error allocating %s\n",
+				prgname, f->fullname);
+			return NULL;
 		}
+		/* this size may have been set by the user */
+		l = ntohll(f->subdir->s_i.sdb_component.addr_last) + 1;
+		if (l > f->size)
+			f->size = l;
+		if (f->keep && f->size > f->old->size)
+			f->keep = 0; /* it grew: it can't stay there */
+	}
+
+	r = malloc(n * sizeof(*r));
+	if (!r) {
+		fprintf(stderr, "%s: out of memory\n", prgname);
+		return NULL;
+	}
+	nr = pin_ranges(tree, rpos, r);
+	if (nr < 0 || (opt_pack && pack_dir(tree, rpos, r, nr) < 0)) {
+		free(r);
+		return NULL;
+	}
+
+	for (i = 1; i < n; i++) {
+		f = tree + i;
 
-		/* position not mandated: go sequential from previous one */
-		f->rstart = rpos;
-		f->s_d.sdb_component.addr_first = htonll(rpos);
-		l = rpos + f->size - 1;
+		if (f->userpos) /* user-specified position (level 0) */
+			f->rstart = f->ustart;
+		else if (f->keep) /* same place as the previous build */
+			f->rstart = f->old->rstart;
+		else if (!opt_pack) {
+			/* not mandated: go sequential, around pinned ones */
+			while ((c = collides(r, nr, rpos, rpos + f->size)))
+				rpos = SDB_ALIGN(c->end);
+			f->rstart = rpos;
+			rpos = SDB_ALIGN(rpos + f->size);
+		}
+		f->s_d.sdb_component.addr_first = htonll(f->rstart);
+		l = f->rstart + f->size - 1;
 		f->s_d.sdb_component.addr_last = htonll(l);
 		if (l > last) last = l;
+		if (f->subdir) {
+			f->s_b.sdb_child = htonll(f->rstart);
+			set_base(f->subdir, tree->base + f->rstart);
+		}
 		if (getenv("VERBOSE"))
-			fprintf(stderr, "allocated relative %s: %lx to %lx\n",
-				f->fullname, rpos, l);
-		rpos = SDB_ALIGN(rpos + f->size);
+			fprintf(stderr, "allocated relative %s: %llx to %llx\n",
+				f->fullname, (long long)f->rstart,
+				(long long)l);
 	}
+	free(r);
 	/* finally, save the last used byte for the whole directory */
 	tree->s_i.sdb_component.addr_last = htonll(last);
 	return tree;
 }
 
-/* step 3: output the image file */
-static struct sdbf *write_sdb(struct sdbf *tree, FILE *out)
+/*
+ * step 3: output the image file. The layout is known by now, so the
+ * image is assembled in memory by a pool of threads, each file at its
+ * own offset, and then written in a single pass, in address order.
+ * Big files are not staged: they are copied while writing the image.
+ * An image that doesn't fit our address space is not mapped at all:
+ * then every file is direct, and tables are written one by one.
+ */
+#define MAP_LIMIT (SIZE_MAX / 4)
+
+struct copy_job {
+	struct sdbf *f;
+	uint64_t pos;
+	int direct;
+	int skip; /* with -u, unchanged in the previous image */
+	int table; /* f is a directory, only if the image is not mapped */
+};
+
+static struct copy_job *jobs;
+static int njobs, nextjob, copy_errors;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *image; /* anonymous memory, only touched where staged */
+static uint64_t imagesize;
+
+static struct copy_job *new_job(struct sdbf *f, uint64_t pos)
 {
-	int i, j, n, copied;
-	unsigned long pos;
-	struct sdbf *sdbf;
-	FILE *f;
-	char *buf;
+	struct copy_job *j;
 
-	buf = malloc(blocksize);
-	if (!buf) {
-		fprintf(stderr, "%s: out of memory\n", prgname);
-		return NULL;
+	if (!(njobs & 63)) {
+		jobs = realloc(jobs, (njobs + 64) * sizeof(*jobs));
+		if (!jobs) {
+			fprintf(stderr, "%s: out of memory\n", prgname);
+			exit(1);
+		}
 	}
-	n = ntohs(tree->s_i.sdb_records);
+	j = jobs + njobs++;
+	memset(j, 0, sizeof(*j));
+	j->f = f;
+	j->pos = pos;
+	return j;
+}
 
-	/*
-	 * First, write the directory, from its possibly user-set position.
-	 * Meanwhile, update base for each of them (used in subdirs)
-	 */
-	fseek(out, tree->base + tree->ustart, SEEK_SET);
+static void collect_jobs(struct sdbf *tree)
+{
+	int i, n = ntohs(tree->s_i.sdb_records);
+	struct sdbf *f;
+	struct mentry *m;
+	struct copy_job *j;
+	uint64_t pos;
+
+	pos = tree->base + tree->ustart
+		+ (n + tree->ndigests) * sizeof(struct sdb_device);
+	if (pos > imagesize)
+		imagesize = pos;
+	for (i = 1; i < n; i++) {
+		f = tree + i;
+		m = f->old;
+		if (f->subdir) {
+			if (m && m->first == f->subdir->base)
+				m->same = 1;
+			collect_jobs(f->subdir);
+			continue;
+		}
+		if (f->userpos) /* only at level 0 */
+			pos = f->ustart;
+		else
+			pos = tree->base + f->rstart;
+		j = new_job(f, pos);
+		j->direct = f->stbuf.st_size > opt_direct;
+		if (m && m->first == pos) {
+			m->same = 1;
+			m->newsize = f->stbuf.st_size;
+			/* same size and mtime: trust the manifest */
+			if (m->filesize == f->stbuf.st_size
+			    && m->mtime_sec == f->stbuf.st_mtim.tv_sec
+			    && m->mtime_nsec == f->stbuf.st_mtim.tv_nsec) {
+				j->skip = 1;
+				f->crc = m->crc;
+			}
+		}
+		if (pos + f->stbuf.st_size > lastwritten)
+			lastwritten = pos + f->stbuf.st_size;
+	}
+	if (lastwritten > imagesize)
+		imagesize = lastwritten;
+}
+
+/* Tables are jobs too, if they can't be staged in the image */
+static void collect_tables(struct sdbf *tree)
+{
+	int i, n = ntohs(tree->s_i.sdb_records);
+
+	new_job(tree, tree->base + tree->ustart)->table = 1;
+	for (i = 1; i < n; i++)
+		if (tree[i].subdir)
+			collect_tables(tree[i].subdir);
+}
+
+static uint64_t job_size(struct copy_job *j)
+{
+	struct sdbf *f = j->f;
+
+	if (j->table)
+		return (ntohs(f->s_i.sdb_records) + f->ndigests)
+			* sizeof(struct sdb_device);
+	return f->stbuf.st_size;
+}
+
+static int job_cmp(const void *a, const void *b)
+{
+	const struct copy_job *ja = a, *jb = b;
+
+	return ja->pos < jb->pos ? -1 : ja->pos > jb->pos;
+}
+
+static int pwrite_all(int fd, const void *buf, uint64_t count, uint64_t pos)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	for (; count; count -= n, p += n, pos += n) {
+		n = pwrite(fd, p, count > (1 << 30) ? 1 << 30 : count, pos);
+		if (n < 0)
+			return -1;
+		if (n == 0) {
+			errno = EIO;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int zero_range(int out, uint64_t pos, uint64_t len)
+{
+	static char zero[64 * 1024];
+	uint64_t n;
+
+	for (; len; len -= n, pos += n) {
+		n = len > sizeof(zero) ? sizeof(zero) : len;
+		if (pwrite_all(out, zero, n, pos) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* The digest of a direct file: mapped if it fits, or read in chunks */
+static int digest_direct(int fd, uint64_t size, uint32_t *crc)
+{
+	char buf[64 * 1024];
+	uint64_t done;
+	ssize_t n;
+	void *p;
+
+	if (size <= MAP_LIMIT) {
+		p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			*crc = sdbfs_crc32c(0, p, size);
+			munmap(p, size);
+			return 0;
+		}
+	}
+	for (*crc = 0, done = 0; done < size; done += n) {
+		n = size - done > sizeof(buf) ? sizeof(buf) : size - done;
+		n = pread(fd, buf, n, done);
+		if (n < 0)
+			return -1;
+		if (n == 0) {
+			errno = EIO; /* the file shrank */
+			return -1;
+		}
+		*crc = sdbfs_crc32c(*crc, buf, n);
+	}
+	return 0;
+}
+
+/* Read a file in its place in the image, or only its digest if direct */
+static int stage_file(struct copy_job *j)
+{
+	struct sdbf *f = j->f;
+	uint64_t size = f->stbuf.st_size, done;
+	char *buf = image + j->pos;
+	ssize_t n;
+	int fd;
+
+	fd = open(f->fullname, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s: %s -- ignoring\n", prgname,
+			f->fullname, strerror(errno));
+		j->direct = 0; /* nothing to copy, later */
+		return 0;
+	}
+	if (j->direct) {
+		if ((opt_digest || opt_update) && size
+		    && digest_direct(fd, size, &f->crc) < 0)
+			goto err;
+		close(fd);
+		return 0;
+	}
+	for (done = 0; done < size; done += n) {
+		n = size - done > (1 << 30) ? 1 << 30 : size - done;
+		n = pread(fd, buf + done, n, done);
+		if (n < 0)
+			goto err;
+		if (n == 0) {
+			errno = EIO; /* the file shrank */
+			goto err;
+		}
+	}
+	if (opt_digest || opt_update)
+		f->crc = sdbfs_crc32c(0, buf, done);
+	close(fd);
+	return 0;
+err:
+	fprintf(stderr, "%s: %s: %s\n", prgname, f->fullname, strerror(errno));
+	close(fd);
+	return -1;
+}
+
+/*
+ * With -S, zero blocks are not written and data extents are reported.
+ * Extents are merged as they come, because they come in address order.
+ */
+#define SPARSE_BLOCK 4096
+
+static uint64_t ext_start, ext_end, payload;
+
+static void flush_extent(void)
+{
+	if (ext_end == ext_start)
+		return;
+	printf("data 0x%08llx-0x%08llx\n", (long long)ext_start,
+	       (long long)ext_end - 1);
+	payload += ext_end - ext_start;
+	ext_start = ext_end;
+}
+
+static void add_extent(uint64_t start, uint64_t end)
+{
+	if (start != ext_end) {
+		flush_extent();
+		ext_start = start;
+	}
+	ext_end = end;
+}
+
+static int is_zero(const char *p, uint64_t n)
+{
+	return !p[0] && !memcmp(p, p + 1, n - 1);
+}
+
+static inline uint64_t block_end(uint64_t pos, uint64_t end)
+{
+	pos = (pos | (SPARSE_BLOCK - 1)) + 1;
+	return pos < end ? pos : end;
+}
+
+/* Write a staged range of the image, possibly leaving holes */
+static int write_image(int out, uint64_t pos, uint64_t end)
+{
+	uint64_t data;
+
+	if (!image) /* not mapped: only zeros between tables and files */
+		return opt_sparse ? 0 : zero_range(out, pos, end - pos);
+	if (!opt_sparse)
+		return pwrite_all(out, image + pos, end - pos, pos);
+	while (pos < end) {
+		for (; pos < end; pos = block_end(pos, end))
+			if (!is_zero(image + pos, block_end(pos, end) - pos))
+				break;
+		for (data = pos; pos < end; pos = block_end(pos, end))
+			if (is_zero(image + pos, block_end(pos, end) - pos))
+				break;
+		if (pos == data)
+			continue;
+		if (pwrite_all(out, image + data, pos - data, data) < 0)
+			return -1;
+		add_extent(data, pos);
+	}
+	return 0;
+}
+
+/* Copy a range of a direct file, so data can stay in the kernel */
+static int copy_range(int fd, uint64_t from, uint64_t to, int out,
+		      uint64_t pos)
+{
+	char buf[64 * 1024];
+	loff_t ipos = from, opos = pos + from;
+	ssize_t n;
+
+	for (; from < to; from += n) {
+		n = copy_file_range(fd, &ipos, out, &opos, to - from, 0);
+		if (n <= 0)
+			break;
+	}
+	for (; from < to; from += n) {
+		n = to - from > sizeof(buf) ? sizeof(buf) : to - from;
+		n = pread(fd, buf, n, from);
+		if (n < 0)
+			return -1;
+		if (n == 0) {
+			errno = EIO; /* the file shrank */
+			return -1;
+		}
+		if (pwrite_all(out, buf, n, pos + from) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Direct files are copied while writing; with -S, only their data */
+static int copy_direct(struct copy_job *j, int out)
+{
+	struct sdbf *f = j->f;
+	uint64_t size = f->stbuf.st_size;
+	off_t data, hole;
+	struct stat st;
+	int fd, ret = 0;
+
+	fd = open(f->fullname, O_RDONLY);
+	if (fd < 0)
+		return 0; /* reported already */
+	for (hole = 0; !ret && hole < size; ) {
+		data = opt_sparse ? lseek(fd, hole, SEEK_DATA) : hole;
+		if (data < 0 && errno == ENXIO)
+			break; /* a hole up to the end */
+		if (data < 0)
+			data = hole; /* no hole support, all data */
+		hole = opt_sparse ? lseek(fd, data, SEEK_HOLE) : size;
+		if (hole < 0 || hole > size)
+			hole = size;
+		ret = copy_range(fd, data, hole, out, j->pos);
+		if (opt_sparse)
+			add_extent(j->pos + data, j->pos + hole);
+	}
+	/* a trailing hole looks like a file that shrank: tell them apart */
+	if (!ret && fstat(fd, &st) < 0) {
+		ret = -1;
+	} else if (!ret && st.st_size < size) {
+		errno = EIO;
+		ret = -1;
+	}
+	if (ret)
+		fprintf(stderr, "%s: copying %s: %s\n", prgname, f->fullname,
+			strerror(errno));
+	close(fd);
+	return ret;
+}
+
+static void *copy_thread(void *arg)
+{
+	struct copy_job *j;
+
+	for (;;) {
+		pthread_mutex_lock(&job_lock);
+		j = nextjob < njobs ? jobs + nextjob++ : NULL;
+		pthread_mutex_unlock(&job_lock);
+		if (!j)
+			return NULL;
+		if (j->skip || j->table || stage_file(j) == 0)
+			continue;
+		pthread_mutex_lock(&job_lock);
+		copy_errors++;
+		pthread_mutex_unlock(&job_lock);
+	}
+}
+
+static void __fill_digest(struct sdbfs_digest *d, struct sdbf *f)
+{
+	memset(d, 0, sizeof(*d));
+	d->algo = htonl(SDBFS_DIGEST_CRC32C);
+	d->digest = htonl(f->crc);
+	d->addr_first = f->s_d.sdb_component.addr_first;
+	d->length = htonll(f->stbuf.st_size);
+	d->record_type = SDBFS_TYPE_DIGEST;
+}
+
+/* Each table, with its digests, at its possibly user-set position */
+static void stage_table(struct sdbf *tree)
+{
+	int i, j, n = ntohs(tree->s_i.sdb_records);
+	int nrec = n + tree->ndigests;
+	struct sdb_device *t;
+
+	if (image) {
+		t = (void *)(image + tree->base + tree->ustart);
+	} else {
+		t = tree->table = calloc(nrec, sizeof(*t));
+		if (!t) {
+			fprintf(stderr, "%s: out of memory\n", prgname);
+			exit(1);
+		}
+	}
+	/* Meanwhile, update base for each of them (used in subdirs) */
 	for (i = 0; i < n; i++) {
-		fwrite(&tree[i].s_d, sizeof(tree[i].s_d), 1, out);
+		t[i] = tree[i].s_d;
 		if (i > 1) /* don't change initial base */
 			tree[i].base = tree[0].base + tree[i].rstart;
+		if (tree[i].subdir)
+			stage_table(tree[i].subdir);
 	}
+	((struct sdb_interconnect *)t)->sdb_records = htons(nrec);
+	for (i = 1, j = n; j < nrec; i++)
+		if (!tree[i].subdir)
+			__fill_digest((void *)(t + j++), tree + i);
 	if (getenv("VERBOSE")) /* show the user */
 		dump_tree(tree);
+}
 
-	/* then each file */
-	for (i = 1; i < n; i++) {
-		sdbf = tree + i;
-		f = fopen(sdbf->fullname, "r");
-		if (!f) {
-			fprintf(stderr, "%s: %s: %s -- ignoring\n", prgname,
-				sdbf->fullname, strerror(errno));
+/*
+ * With -u, the previous image is updated in place. Old data that is not
+ * in the same place any more is cleared first, then changed files and
+ * changed records are written. Other bytes are neither read nor written.
+ */
+static int nupdated, nrecords, ncleared;
+
+static int clear_range(int out, uint64_t pos, uint64_t len)
+{
+	if (pos >= imagesize)
+		return 0; /* the file is truncated later */
+	if (len > imagesize - pos)
+		len = imagesize - pos;
+	if (!len)
+		return 0;
+	ncleared++;
+	if (opt_sparse && fallocate(out, FALLOC_FL_PUNCH_HOLE
+				    | FALLOC_FL_KEEP_SIZE, pos, len) == 0)
+		return 0;
+	return zero_range(out, pos, len);
+}
+
+/* Compare the staged table with the previous one, write what differs */
+static int update_table(struct sdbf *tree, int out)
+{
+	int i, n = ntohs(tree->s_i.sdb_records);
+	int nrec = n + tree->ndigests, oldrec = 0;
+	uint64_t pos = tree->base + tree->ustart;
+	struct sdb_interconnect dot;
+	struct sdb_device *t, *old;
+
+	for (i = 1; i < n; i++)
+		if (tree[i].subdir && update_table(tree[i].subdir, out) < 0)
+			return -1;
+	if (pread(out, &dot, sizeof(dot), pos) == sizeof(dot)
+	    && ntohl(dot.sdb_magic) == SDB_MAGIC)
+		oldrec = ntohs(dot.sdb_records);
+	old = calloc(nrec > oldrec ? nrec : oldrec, sizeof(*old));
+	if (!old)
+		return -1;
+	if (pread(out, old, oldrec * sizeof(*old), pos) < 0)
+		oldrec = 0;
+	t = image ? (void *)(image + pos) : tree->table;
+	for (i = 0; i < nrec; i++) {
+		if (i < oldrec && !memcmp(old + i, t + i, sizeof(*t)))
 			continue;
-		}
+		if (pwrite_all(out, t + i, sizeof(*t), pos + i * sizeof(*t)))
+			break;
+		nrecords++;
+	}
+	free(old);
+	if (i < nrec)
+		return -1;
+	if (oldrec > nrec)
+		return clear_range(out, pos + nrec * sizeof(*t),
+				   (oldrec - nrec) * sizeof(*t));
+	return 0;
+}
 
-		if (sdbf->userpos) /* only at level 0 */
-			fseek(out, sdbf->ustart, SEEK_SET);
-		else
-			fseek(out, tree->base + sdbf->rstart, SEEK_SET);
+static int update_image(struct sdbf *tree, int out)
+{
+	struct copy_job *j;
+	struct mentry *m;
+	struct stat st;
+	int i, ret = 0;
 
-		if (sdbf->subdir) {
-			write_sdb(sdbf->subdir, out);
-			fclose(f);
+	/* Files that were touched but not changed need no rewrite */
+	for (i = 0; i < njobs; i++) {
+		j = jobs + i;
+		m = j->f->old;
+		if (!j->skip && !j->table && m && m->same && m->filesize == m->newsize
+		    && m->crc == j->f->crc)
+			j->skip = 1;
+	}
+	for (i = 0; !ret && i < nmentries; i++) {
+		m = mentries + i;
+		if (!m->same)
+			ret = clear_range(out, m->first,
+					  m->isdir ? m->size : m->filesize);
+		else if (!m->isdir && m->newsize < m->filesize)
+			ret = clear_range(out, m->first + m->newsize,
+					  m->filesize - m->newsize);
+	}
+	for (i = 0; !ret && i < njobs; i++) {
+		j = jobs + i;
+		if (j->skip || j->table) /* tables are compared below */
+			continue;
+		nupdated++;
+		if (!j->direct) {
+			ret = pwrite_all(out, image + j->pos,
+					 j->f->stbuf.st_size, j->pos);
 			continue;
 		}
+		/* with -S, holes in the file must be holes in the image */
+		if (opt_sparse)
+			ret = clear_range(out, j->pos, j->f->stbuf.st_size);
+		if (!ret && copy_direct(j, out) < 0)
+			return -1;
+	}
+	if (!ret) {
+		stage_table(tree);
+		ret = update_table(tree, out);
+	}
+	if (!ret && fstat(out, &st) == 0 && S_ISREG(st.st_mode)
+	    && st.st_size != imagesize)
+		ret = ftruncate(out, imagesize);
+	if (ret < 0) {
+		fprintf(stderr, "%s: write: %s\n", prgname, strerror(errno));
+		return -1;
+	}
+	if (image)
+		munmap(image, imagesize);
+	printf("updated %i files and %i records, cleared %i ranges\n",
+	       nupdated, nrecords, ncleared);
+	return 0;
+}
+
+static struct sdbf *write_sdb(struct sdbf *tree, int out)
+{
+	pthread_t th[64];
+	struct copy_job *j;
+	uint64_t pos, len;
+	int i, n = opt_jobs;
+
+	collect_jobs(tree);
+	if (devsize > imagesize)
+		imagesize = devsize; /* padding is written like the rest */
+	image = NULL;
+	if (imagesize <= MAP_LIMIT)
+		image = mmap(NULL, imagesize, PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			     -1, 0);
+	if (!image || image == MAP_FAILED) {
+		if (getenv("VERBOSE"))
+			fprintf(stderr, "%s: 0x%llx bytes not mapped, writing"
+				" file by file\n", prgname,
+				(long long)imagesize);
+		image = NULL;
+		for (i = 0; i < njobs; i++)
+			jobs[i].direct = 1;
+		collect_tables(tree);
+	}
+	qsort(jobs, njobs, sizeof(*jobs), job_cmp);
+
+	if (n > njobs)
+		n = njobs;
+	for (i = 0; i < n; i++)
+		if (pthread_create(th + i, NULL, copy_thread, NULL))
+			break;
+	if (!i)
+		copy_thread(NULL); /* no threads at all: do it ourselves */
+	while (i--)
+		pthread_join(th[i], NULL);
+	if (copy_errors)
+		return NULL;
+	if (incremental)
+		return update_image(tree, out) < 0 ? NULL : tree;
+	stage_table(tree);
 
-		for (copied = 0; copied < sdbf->stbuf.st_size; ) {
-			j = fread(buf, 1, blocksize, f);
-			if (j <= 0)
-				break; /* unlikely */
-			fwrite(buf, 1, j, out);
-			copied += j;
-			pos = ftell(out);
-			if (pos > lastwritten)
-				lastwritten = pos;
+	/* Finally, write it all in address order */
+	for (pos = 0, i = 0; i < njobs; i++) {
+		j = jobs + i;
+		if (!j->direct && !j->table)
+			continue;
+		if (write_image(out, pos, j->pos) < 0)
+			goto err;
+		len = job_size(j);
+		if (j->table) {
+			if (pwrite_all(out, j->f->table, len, j->pos) < 0)
+				goto err;
+			if (opt_sparse)
+				add_extent(j->pos, j->pos + len);
+		} else if (copy_direct(j, out) < 0) {
+			return NULL;
 		}
-		fclose(f);
+		pos = j->pos + len;
+	}
+	if (write_image(out, pos, imagesize) < 0)
+		goto err;
+	if (image)
+		munmap(image, imagesize);
+	if (opt_sparse) {
+		/* trailing holes are only there if we set the size */
+		if (ftruncate(out, imagesize) < 0)
+			goto err;
+		flush_extent();
+		printf("payload 0x%llx bytes in an image of 0x%llx\n",
+		       (long long)payload, (long long)imagesize);
 	}
-	free(buf);
 	return tree;
+err:
+	fprintf(stderr, "%s: write: %s\n", prgname, strerror(errno));
+	return NULL;
+}
+
+/*
+ * With -E, the new image is compared with the previous one (-p), by
+ * erase block. Changed blocks are listed and saved as a patch (-P) or
+ * written to the target (-T), that is the previous image by default.
+ */
+static uint64_t run_start, run_end;
+
+static void flush_run(void)
+{
+	if (run_end != run_start)
+		printf("delta 0x%08llx-0x%08llx\n", (long long)run_start,
+		       (long long)run_end - 1);
+}
+
+static int make_delta(int out)
+{
+	struct sdbfs_patch h;
+	struct sdbfs_patch_block b;
+	uint64_t pos, len, oldsize, nblocks = 0, pfpos = sizeof(h);
+	uint32_t crc = 0;
+	char *name, *nbuf, *obuf;
+	int old, tgt = -1, pf = -1, n = 0;
+	struct stat st;
+	ssize_t ret;
+	off_t size;
+
+	name = opt_prev ? opt_prev : opt_target;
+	old = open(name, O_RDONLY);
+	if (old < 0)
+		goto err;
+	size = lseek(old, 0, SEEK_END); /* block devices have no st_size */
+	oldsize = size < 0 ? 0 : size;
+	name = opt_target;
+	if (opt_target && (tgt = open(opt_target, O_WRONLY)) < 0)
+		goto err;
+	name = opt_patch;
+	if (opt_patch && (pf = open(opt_patch, O_WRONLY | O_CREAT | O_TRUNC,
+				    0666)) < 0)
+		goto err;
+	nbuf = malloc(2 * opt_erase);
+	if (!nbuf) {
+		fprintf(stderr, "%s: out of memory\n", prgname);
+		return -1;
+	}
+	obuf = nbuf + opt_erase;
+
+	for (pos = 0; pos < imagesize; pos += len, nblocks++) {
+		len = imagesize - pos > opt_erase ? opt_erase : imagesize - pos;
+		name = "image";
+		ret = pread(out, nbuf, len, pos);
+		if (ret != len) {
+			if (ret >= 0)
+				errno = EIO; /* short read */
+			goto err;
+		}
+		crc = sdbfs_crc32c(crc, nbuf, len);
+		memset(&b, 0, sizeof(b));
+		if (pos + len <= oldsize && pread(old, obuf, len, pos) == len) {
+			if (!memcmp(nbuf, obuf, len))
+				continue;
+			b.old_crc = htonl(sdbfs_crc32c(0, obuf, len));
+		} else {
+			b.flags = htonl(SDBFS_PATCH_ANYOLD);
+		}
+		b.offset = htonll(pos);
+		b.length = htonl(len);
+		b.new_crc = htonl(sdbfs_crc32c(0, nbuf, len));
+		if (pos != run_end) {
+			flush_run();
+			run_start = pos;
+		}
+		run_end = pos + len;
+		n++;
+
+		name = opt_target;
+		if (tgt >= 0 && pwrite_all(tgt, nbuf, len, pos) < 0)
+			goto err;
+		name = opt_patch;
+		if (pf >= 0 && pwrite_all(pf, &b, sizeof(b), pfpos) < 0)
+			goto err;
+		pfpos += sizeof(b);
+		if (pf >= 0 && pwrite_all(pf, nbuf, len, pfpos) < 0)
+			goto err;
+		pfpos += len;
+	}
+	flush_run();
+	free(nbuf);
+	close(old);
+	if (pf >= 0) {
+		h.magic = htonl(SDBFS_PATCH_MAGIC);
+		h.erase_size = htonl(opt_erase);
+		h.image_size = htonll(imagesize);
+		h.image_crc = htonl(crc);
+		h.nblocks = htonl(n);
+		if (pwrite_all(pf, &h, sizeof(h), 0) < 0 || close(pf) < 0)
+			goto err;
+	}
+	/* a file target must end up equal to the image */
+	name = opt_target;
+	if (tgt >= 0 && fstat(tgt, &st) == 0 && S_ISREG(st.st_mode)
+	    && st.st_size > imagesize && ftruncate(tgt, imagesize) < 0)
+		goto err;
+	if (tgt >= 0 && close(tgt) < 0)
+		goto err;
+	printf("changed %i of %lli erase blocks (0x%llx bytes each)\n",
+	       n, (long long)nblocks, (long long)opt_erase);
+	return 0;
+
+err:
+	fprintf(stderr, "%s: %s: %s\n", prgname, name, strerror(errno));
+	return -1;
 }
 
 /*
@@ -507,6 +1518,16 @@ static int usage(char *prgname)
 		prgname, prgname);
 	fprintf(stderr, "  -b <number> : block size (default 64)\n");
 	fprintf(stderr, "  -s <number> : device size (default: as needed)\n");
+	fprintf(stderr, "  -c          : add a CRC32C digest for each file\n");
+	fprintf(stderr, "  -j <number> : copy threads (default: cpu count)\n");
+	fprintf(stderr, "  -d <number> : bigger files are not staged (1M)\n");
+	fprintf(stderr, "  -S          : sparse output, report data extents\n");
+	fprintf(stderr, "  -u          : update the previous image, if any\n");
+	fprintf(stderr, "  -O          : pack files in less space\n");
+	fprintf(stderr, "  -E <number> : erase size, for the options below\n");
+	fprintf(stderr, "  -p <file>   : previous image, to compare with\n");
+	fprintf(stderr, "  -P <file>   : save changed blocks as a patch\n");
+	fprintf(stderr, "  -T <file>   : write changed blocks to a target\n");
 	fprintf(stderr, "  a file called \"" CFG_NAME "\", in each "
 		"subdir is used as configuration file\n");
 	exit(1);
@@ -514,14 +1535,15 @@ static int usage(char *prgname)
 
 int main(int argc, char **argv)
 {
-	int c;
+	int c, flags;
 	struct stat stbuf;
-	FILE *fout;
+	int fout;
 	char *rest;
 	struct sdbf *tree;
 
 	prgname = argv[0];
-	while ( (c = getopt(argc, argv, "b:s:")) != -1) {
+	opt_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	while ( (c = getopt(argc, argv, "b:s:cj:d:SuOE:p:P:T:")) != -1) {
 		switch (c) {
 		case 'b':
 			blocksize = strtol(optarg, &rest, 0);
@@ -532,7 +1554,52 @@ int main(int argc, char **argv)
 			}
 			break;
 		case 's':
-			devsize = strtol(optarg, &rest, 0);
+			devsize = strtoull(optarg, &rest, 0);
+			if (rest && *rest) {
+				fprintf(stderr, "%s: not a number \"%s\"\n",
+					prgname, optarg);
+				exit(1);
+			}
+			break;
+		case 'c':
+			opt_digest = 1;
+			break;
+		case 'S':
+			opt_sparse = 1;
+			break;
+		case 'u':
+			opt_update = 1;
+			break;
+		case 'O':
+			opt_pack = 1;
+			break;
+		case 'E':
+			opt_erase = strtoull(optarg, &rest, 0);
+			if (rest && *rest) {
+				fprintf(stderr, "%s: not a number \"%s\"\n",
+					prgname, optarg);
+				exit(1);
+			}
+			break;
+		case 'p':
+			opt_prev = optarg;
+			break;
+		case 'P':
+			opt_patch = optarg;
+			break;
+		case 'T':
+			opt_target = optarg;
+			break;
+		case 'd':
+			opt_direct = strtoull(optarg, &rest, 0);
+			if (rest && *rest) {
+				fprintf(stderr, "%s: not a number \"%s\"\n",
+					prgname, optarg);
+				exit(1);
+			}
+			break;
+		case 'j':
+			opt_jobs = strtol(optarg, &rest, 0);
 			if (rest && *rest) {
 				fprintf(stderr, "%s: not a number \"%s\"\n",
 					prgname, optarg);
@@ -543,6 +1610,14 @@ int main(int argc, char **argv)
 	}
 	if (optind != argc - 2)
 		usage(prgname);
+	if (opt_jobs > 64) /* see write_sdb() */
+		opt_jobs = 64;
+	if (!opt_erase != !(opt_prev || opt_target) || opt_erase > 1 << 30
+	    || (opt_patch && !opt_erase)) {
+		fprintf(stderr, "%s: -E needs -p or -T, and -p/-P/-T need -E\n",
+			prgname);
+		exit(1);
+	}
 
 	/* check input and output */
 	if (stat(argv[optind], &stbuf) < 0) {
@@ -556,34 +1631,67 @@ int main(int argc, char **argv)
 			argv[optind]);
 		exit(1);
 	}
-	fout = fopen(argv[optind+1], "w");
-	if (!fout) {
+	rootlen = strlen(argv[optind]) + 1;
+	if (opt_update)
+		load_manifest(argv[optind+1]);
+	if (opt_prev && stat(opt_prev, &stbuf) == 0) {
+		struct stat st;
+
+		if (stat(argv[optind+1], &st) == 0 && st.st_dev == stbuf.st_dev
+		    && st.st_ino == stbuf.st_ino) {
+			fprintf(stderr, "%s: %s: the previous image can't be"
+				" the output\n", prgname, opt_prev);
+			exit(1);
+		}
+	}
+	/* the image is read back if updated in place or compared */
+	flags = O_WRONLY | O_CREAT | O_TRUNC;
+	if (opt_erase)
+		flags = O_RDWR | O_CREAT | O_TRUNC;
+	if (incremental)
+		flags = O_RDWR;
+	fout = open(argv[optind+1], flags, 0666);
+	if (fout < 0) {
 		fprintf(stderr, "%s: %s: %s\n", prgname, argv[optind+1],
 			strerror(errno));
 		exit(1);
 	}
+	if (opt_sparse && (fstat(fout, &stbuf) < 0
+			   || !S_ISREG(stbuf.st_mode))) {
+		fprintf(stderr, "%s: %s: not a regular file, can't be sparse\n",
+			prgname, argv[optind+1]);
+		opt_sparse = 0;
+	}
 
 	tree = prepare_dir(argv[optind], NULL /* parent */);
 	if (!tree)
 		exit(1);
 
-	/* allocate space in the storage */
+	/* allocate space in the storage, possibly as it was before */
+	if (incremental)
+		apply_manifest(tree);
 	tree = alloc_storage(tree);
 	if (!tree)
 		exit(1);
+	if (opt_pack)
+		printf("packed 0x%llx bytes, 0x%llx free in %i holes"
+		       " (largest 0x%llx)\n", (long long)pack_used,
+		       (long long)pack_free, pack_holes,
+		       (long long)pack_largest);
 
 	/* write out the whole tree, recusively */
 	tree = write_sdb(tree, fout);
 	if (!tree)
 		exit(1);
-	if (lastwritten < devsize) {
-		fseek(fout, devsize - 1, SEEK_SET);
-		fwrite("\0", 1, 1, fout);
-	}
-	fclose(fout);
+	if (opt_update && save_manifest(tree, argv[optind+1], fout) < 0)
+		exit(1);
+	if (opt_erase && make_delta(fout) < 0)
+		exit(1);
+	close(fout);
 	if (devsize && (lastwritten > devsize)) {
-		fprintf(stderr, "%s: data storage (0x%lx) exceeds device size"
-			" (0x%lx)\n", prgname, lastwritten, devsize);
+		fprintf(stderr, "%s: data storage (0x%llx) exceeds device size"
+			" (0x%llx)\n", prgname, (long long)lastwritten,
+			(long long)devsize);
 		exit(1);
 	}
 	exit(0);
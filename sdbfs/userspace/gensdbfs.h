@@ -16,27 +16,32 @@ struct sdbf {
 	};
 	char *fullname;
 	char *basename;
-	unsigned long ustart, rstart;	/* user (mandated), relative */
-	unsigned long base, size;	/* base is absolute, for output */
-	int nfiles, totsize;		/* for dirs */
+	uint64_t ustart, rstart;	/* user (mandated), relative */
+	uint64_t base, size;		/* base is absolute, for output */
+	int nfiles;			/* for dirs */
+	int ndigests;			/* for dirs, with -c */
+	uint32_t crc;			/* for files, with -c */
+	uint64_t totsize;		/* for dirs */
 	struct sdbf *dot;		/* for files, pointer to owning dir */
 	struct sdbf *parent;		/* for dirs, current dir in ../ */
 	struct sdbf *subdir;		/* for files that are dirs */
 	int level;			/* subdir level */
 	int userpos;			/* only allowed at level 0 */
+	struct mentry *old;		/* with -u, from the manifest */
+	int keep;			/* with -u, stays where it was */
+	struct sdb_device *table;	/* for dirs, if the image isn't mapped */
 };
 
-static inline uint64_t htonll(uint64_t ll)
-{
-	uint64_t res;
-
-	if (htonl(1) == 1)
-		return ll;
-	res = htonl(ll >> 32);
-	res |= (uint64_t)(htonl((uint32_t)ll)) << 32;
-	return res;
-}
-
-#define ntohll htonll
+/* With -u, each entry of the previous build is described in a manifest */
+struct mentry {
+	char *path;			/* relative to the input directory */
+	int isdir;
+	uint64_t rstart, first;		/* relative, absolute */
+	uint64_t size, filesize;	/* allocated, data */
+	uint64_t mtime_sec, mtime_nsec;
+	uint32_t crc;
+	int same;			/* still at "first" in the new image */
+	uint64_t newsize;		/* the new filesize, if same */
+};
 
 #endif /* __GENSDBFS_H__ */
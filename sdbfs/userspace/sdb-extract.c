@@ -23,6 +23,7 @@
 #include <sys/mman.h>
 
 #include "libsdbfs.h"
+#include "sparse.h"
 #define CFG_NAME "--SDB-CONFIG--"
 
 /*
@@ -32,15 +33,46 @@
 
 char *prgname;
 
-static int opt_force, opt_entry;
+static int opt_force, opt_search;
+static unsigned long long opt_entry;
+static int imgfd;
+static char *fsname;
 
-static int create_file(struct sdbfs *fs, struct sdb_device *d, FILE *cfgf)
+/* While walking, we are in the directory of the current depth */
+#define EXTRACT_DEPTH 32
+static FILE *cfgfiles[EXTRACT_DEPTH];
+static int curdepth;
+
+/* Each directory has its own config file, like gensdbfs wants */
+static FILE *open_config(const char *dirname)
 {
-	FILE *f;
+	FILE *cfgf;
+	int cfgfd;
+
+	cfgfd = open(CFG_NAME, O_RDWR | O_CREAT | O_EXCL, 0666);
+	if (cfgfd < 0) {
+		fprintf(stderr, "%s: Warning: %s/%s: %s\n", prgname, dirname,
+			CFG_NAME, strerror(errno));
+		cfgf = fopen("/dev/null", "w");
+	} else {
+		cfgf = fdopen(cfgfd, "w");
+	}
+
+	/* Save the header */
+	fprintf(cfgf, "# Configuration file generated by %s, reading %s\n\n",
+		prgname, fsname);
+	return cfgf;
+}
+
+static int create_file(struct sdbfs *fs, struct sdb_device *d, int depth,
+		       sdbfs_off_t base, FILE *cfgf)
+{
+	int fd;
 	struct sdb_product *p;
 	struct sdb_component *c;
 	char name[32];
 	int mode = 0444;
+	sdbfs_off_t first;
 
 	c = &d->sdb_component;
 	p = &c->product;
@@ -53,8 +85,10 @@ static int create_file(struct sdbfs *fs, struct sdb_device *d, FILE *cfgf)
 
 	/* Print cfgfile information */
 	fprintf(cfgf, "%s\n" "\tvendor = 0x%016llx\n" "\tdevice = 0x%08x\n",
-		name, ntohll(p->vendor_id), ntohl(p->device_id));
-	fprintf(cfgf, "\tposition = 0x%llx\n", ntohll(c->addr_first));
+		name, (long long)ntohll(p->vendor_id), ntohl(p->device_id));
+	if (!depth) /* gensdbfs only allows it at the top level */
+		fprintf(cfgf, "\tposition = 0x%llx\n",
+			(long long)ntohll(c->addr_first));
 	if (ntohl(d->bus_specific) & SDB_DATA_WRITE) {
 		fprintf(cfgf, "\twrite = 1\n");
 		mode |= 0222;
@@ -63,46 +97,109 @@ static int create_file(struct sdbfs *fs, struct sdb_device *d, FILE *cfgf)
 		mode |= 0111;
 	fprintf(cfgf, "\n");
 
-	/* Create the actual file unless it is the root directory */
-	if (!strcmp(name, "."))
+	/* Create the actual file unless it is a directory's own record */
+	if (p->record_type == sdb_type_interconnect)
 		return 0;
-	f = fopen(name, "w");
-	if (!f) {
+	if (!name[0] || !strcmp(name, ".") || !strcmp(name, "..")
+	    || strchr(name, '/')) {
+		fprintf(stderr, "%s: invalid name \"%s\"\n", prgname, name);
+		return -1;
+	}
+	if (p->record_type == sdb_type_bridge) {
+		if (mkdir(name, 0777) < 0 && errno != EEXIST) {
+			fprintf(stderr, "%s: mkdir(%s): %s\n", prgname, name,
+				strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+	fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
 		fprintf(stderr, "%s: open(%s): %s\n", prgname, name,
 			strerror(errno));
 		return -1;
 	}
-	fwrite(fs->data + ntohll(c->addr_first), 1,
-	       ntohll(c->addr_last) + 1 - ntohll(c->addr_first), f);
-	fclose(f);
+	first = base + ntohll(c->addr_first);
+	if (write_sparse(imgfd, fd, fs->data + first, first,
+			 base + ntohll(c->addr_last) + 1) < 0)
+		fprintf(stderr, "%s: write(%s): %s\n", prgname, name,
+			strerror(errno));
+	close(fd);
 	chmod(name, mode);
 	return 0;
 }
 
+/* Go back up to the directory of "depth", when a subdirectory is over */
+static void leave_dirs(int depth)
+{
+	for (; curdepth > depth; curdepth--) {
+		fclose(cfgfiles[curdepth]);
+		if (chdir("..") < 0) {
+			fprintf(stderr, "%s: chdir(..): %s\n", prgname,
+				strerror(errno));
+			exit(1);
+		}
+	}
+}
+
+/* Bridges become subdirectories, so gensdbfs can rebuild the image */
+static int extract_cb(struct sdbfs *fs, struct sdb_device *d, int depth,
+		      sdbfs_off_t base, void *arg)
+{
+	struct sdb_product *p = &d->sdb_component.product;
+	char name[20];
+	int i;
+
+	/* metadata (e.g., digests, see gensdbfs -c) is not a file */
+	if (p->record_type & 0x80)
+		return SDBFS_WALK_SKIP;
+	leave_dirs(depth);
+	if (create_file(fs, d, depth, base, cfgfiles[depth]) < 0)
+		return SDBFS_WALK_SKIP;
+	if (p->record_type != sdb_type_bridge)
+		return SDBFS_WALK_DESCEND;
+
+	/* the walker enters it next: our stack is as deep as its stack */
+	sprintf(name, "%.19s", p->name);
+	for (i = strlen(name); i > 0 && name[i - 1] == ' ';)
+		name[--i] = '\0';
+	if (depth + 1 >= EXTRACT_DEPTH || chdir(name) < 0) {
+		fprintf(stderr, "%s: %s: not extracted\n", prgname, name);
+		return SDBFS_WALK_SKIP;
+	}
+	curdepth = depth + 1;
+	cfgfiles[curdepth] = open_config(name);
+	return SDBFS_WALK_DESCEND;
+}
+
 
 /* As promised, here's the user-interface glue (and initialization, I admit) */
 int main(int argc, char **argv)
 {
-	int n, new, c, err, cfgfd;
-	FILE *f, *cfgf;
+	int n, c, err;
+	FILE *f;
 	struct sdbfs _fs;
 	struct sdbfs *fs = &_fs; /* I like to type "fs->" */
-	struct sdb_device *d;
 	struct stat stbuf;
 	void *mapaddr;
-	char *fsname, *dirname;
+	char *dirname;
 	struct dirent **namelist;
-	int i, pagesize = getpagesize();
+	int pagesize = getpagesize();
+	size_t i;
+	static struct sdbfs_level stack[EXTRACT_DEPTH];
 
 	prgname = argv[0];
 
-	while ( (c = getopt(argc, argv, "e:f")) != -1) {
+	while ( (c = getopt(argc, argv, "ae:f")) != -1) {
 		switch (c) {
 		case 'f':
 			opt_force = 1;
 			break;
+		case 'a':
+			opt_search = 1;
+			break;
 		case 'e':
-			if (sscanf(optarg, "%i", &opt_entry) != 1) {
+			if (sscanf(optarg, "%lli", &opt_entry) != 1) {
 				fprintf(stderr, "%s: not a number \"%s\"\n",
 					prgname, optarg);
 				exit(1);
@@ -110,7 +207,7 @@ int main(int argc, char **argv)
 		}
 	}
 	if (optind != argc - 2) {
-		fprintf(stderr, "%s: Use: \"%s [-f] [-e <entry>] "
+		fprintf(stderr, "%s: Use: \"%s [-f] [-a] [-e <entry>] "
 			"<output-dir> <sdb-file>\n", prgname, prgname);
 		exit(1);
 	}
@@ -123,6 +220,7 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
+	imgfd = fileno(f);
 	stbuf.st_size += pagesize - 1;
 	stbuf.st_size &= ~(pagesize - 1);
 	mapaddr = mmap(0, stbuf.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
@@ -151,13 +249,21 @@ int main(int argc, char **argv)
 	fs->blocksize = 256; /* only used for writing, actually */
 	fs->entrypoint = opt_entry;
 	fs->data = mapaddr;
+	fs->datalen = stbuf.st_size;
+	fs->stack = stack;
+	fs->maxdepth = EXTRACT_DEPTH;
 
+	if (opt_search && sdbfs_find_entry(fs) < 0) {
+		fprintf(stderr, "%s: %s: no sdb table found\n", prgname,
+			fsname);
+		exit(1);
+	}
 	err = sdbfs_dev_create(fs);
 	if (err) {
 		fprintf(stderr, "%s: sdbfs_dev_create(): %s\n", prgname,
 			strerror(-err));
-		fprintf(stderr, "\t(wrong entry point 0x%08lx?)\n",
-			fs->entrypoint);
+		fprintf(stderr, "\t(wrong entry point 0x%08llx?)\n",
+			(long long)fs->entrypoint);
 		exit(1);
 	}
 
@@ -178,24 +284,15 @@ int main(int argc, char **argv)
 		fprintf(stderr, "%s: %s: not empty\n", prgname, dirname);
 		exit(1);
 	}
-	cfgfd = open(CFG_NAME, O_RDWR | O_CREAT | O_EXCL, 0666);
-	if (cfgfd < 0) {
-		fprintf(stderr, "%s: Warning: %s/%s: %s\n", prgname, dirname,
-			CFG_NAME, strerror(errno));
-		cfgf = fopen("/dev/null", "w");
-	} else {
-		cfgf = fdopen(cfgfd, "w");
-	}
-
-	/* Save the header */
-	fprintf(cfgf, "# Configuration file generated by %s, reading %s\n\n",
-		prgname, fsname);
+	cfgfiles[0] = open_config(dirname);
 
 	/* The root directory is a file like the other ones */
-	while ( (d = sdbfs_scan(fs, new)) != NULL) {
-		create_file(fs, d, cfgf);
-		new = 0;
-	}
+	err = sdbfs_walk(fs, extract_cb, NULL);
+	leave_dirs(0);
+	fclose(cfgfiles[0]);
+	if (err < 0)
+		fprintf(stderr, "%s: some bridges not extracted: %s\n",
+			prgname, strerror(-err));
 	sdbfs_dev_destroy(fs);
 	return 0;
 }
@@ -15,15 +15,19 @@
 #include <string.h>
 #include <getopt.h>
 #include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 
 #include "libsdbfs.h"
+#include "sparse.h"
 
 char *prgname;
 
-int opt_long, opt_verbose, opt_read, opt_entry, opt_mem;
-unsigned long opt_memaddr, opt_memsize;
+int opt_long, opt_verbose, opt_read, opt_mem, opt_search, opt_verify;
+char *opt_apply, *opt_check;
+unsigned long long opt_entry, opt_memaddr, opt_memsize;
 
 static void help(void)
 {
@@ -33,6 +37,10 @@ static void help(void)
 	fprintf(stderr, "   -v          verbose\n");
 	fprintf(stderr, "   -r          force use of read(2), not mmap(2)\n");
 	fprintf(stderr, "   -e <num>    entry point offset\n");
+	fprintf(stderr, "   -a          search the entry point (from -e)\n");
+	fprintf(stderr, "   -c, --verify         check all file digests\n");
+	fprintf(stderr, "   -p, --apply <patch>  apply a gensdbfs patch\n");
+	fprintf(stderr, "   -k, --check <patch>  check a patch is applied\n");
 	fprintf(stderr, "   -m <size>@<addr>     memory subset to use\n");
 	fprintf(stderr, "   -m <addr>+<size>     memory subset to use\n");
 	exit(1);
@@ -41,8 +49,8 @@ static void help(void)
 struct sdbr_drvdata {
 	void *mapaddr;
 	FILE *f;
-	unsigned long memaddr;
-	unsigned long memsize;
+	unsigned long long memaddr;
+	unsigned long long memsize;
 };
 
 /*
@@ -50,29 +58,37 @@ struct sdbr_drvdata {
  * you can't know the size of (e.g., char devices). You can force use of
  * read, to exercise the library procedures, using "-r"
  */
-static int do_read(struct sdbfs *fs, int offset, void *buf, int count)
+static sdbfs_ssize_t do_read(struct sdbfs *fs, sdbfs_off_t offset, void *buf,
+			     sdbfs_ssize_t count)
 {
 	struct sdbr_drvdata *drvdata = fs->drvdata;
 	if (opt_verbose)
-		fprintf(stderr, "%s @ 0x%08x - size 0x%x (%i)\n", __func__,
-			offset, count, count);
+		fprintf(stderr, "%s @ 0x%08llx - size 0x%llx (%lli)\n",
+			__func__, (long long)offset, (long long)count,
+			(long long)count);
 	if (drvdata->mapaddr) {
+		/* Read-ahead may ask for more than what is mapped */
+		if (offset >= fs->datalen)
+			return 0;
+		if (count > fs->datalen - offset)
+			count = fs->datalen - offset;
 		memcpy(buf, drvdata->mapaddr + offset, count);
 		return count;
 	}
 
-	/* not mmapped: seek and read */
-	if (fseek(drvdata->f, drvdata->memaddr + offset, SEEK_SET) < 0)
-		return -1;
-	return fread(buf, 1, count, drvdata->f);
+	/* not mmapped: pread, as verification reads from several threads */
+	count = pread(fileno(drvdata->f), buf, count,
+		      drvdata->memaddr + offset);
+	return count < 0 ? -errno : count;
 }
 
 /* Boring ascii representation of a device */
-static int list_device(struct sdb_device *d, int depth, int base)
+static int list_device(struct sdb_device *d, int depth, sdbfs_off_t base)
 {
 	struct sdb_product *p;
 	struct sdb_component *c;
 	struct sdb_synthesis *s;
+	struct sdbfs_digest *g;
 
 	unsigned char *data;
 	static int warned;
@@ -82,6 +98,7 @@ static int list_device(struct sdb_device *d, int depth, int base)
 	c = &d->sdb_component;
 	p = &c->product;
 	s = (void *)d;
+	g = (void *)d;
 
 	if (!warned && opt_long) {
 		fprintf(stderr, "%s: listing format is to be defined\n",
@@ -156,6 +173,19 @@ static int list_device(struct sdb_device *d, int depth, int base)
 			printf("  build-user: %.15s\n", s->user_name);
 		return 0;
 
+	/* Our own metadata, for the file at the same address */
+	case SDBFS_TYPE_DIGEST:
+		if (!opt_long)
+			return 0;
+		if (ntohl(g->algo) != SDBFS_DIGEST_CRC32C)
+			printf("digest: unknown algorithm %i\n",
+			       ntohl(g->algo));
+		else
+			printf("digest: crc32c %08x, 0x%llx bytes @ %08llx\n",
+			       ntohl(g->digest), (long long)ntohll(g->length),
+			       (long long)base + ntohll(g->addr_first));
+		return 0;
+
 	case sdb_type_empty:
 		return 0;
 
@@ -189,39 +219,200 @@ static int list_device(struct sdb_device *d, int depth, int base)
 	return ret;
 }
 
+static int list_cb(struct sdbfs *fs, struct sdb_device *d, int depth,
+		   sdbfs_off_t base, void *arg)
+{
+	int *err = arg;
+
+	*err += list_device(d, depth, base);
+	return SDBFS_WALK_DESCEND;
+}
+
 /* The following three function perform the real work, main() is just glue */
 static int do_list(struct sdbfs *fs)
 {
-	struct sdb_device *d;
-	int new = 1;
-	int err = 0;
+	int ret, err = 0;
 
-	while ( (d = sdbfs_scan(fs, new)) != NULL) {
-		err += list_device(d, fs->depth, fs->base[fs->depth]);
-		new = 0;
+	ret = sdbfs_walk(fs, list_cb, &err);
+	if (ret < 0) {
+		fprintf(stderr, "%s: some bridges not listed: %s\n", prgname,
+			strerror(-ret));
+		err++;
 	}
 	return err;
 }
 
-static int do_cat_name(struct sdbfs *fs, char *name)
+/*
+ * Verification: collect the path of each file while walking, then
+ * check them from several threads. Each opens its own files, and the
+ * library needs no iterator of ours for that.
+ */
+struct verify_job {
+	char path[32 * 20];		/* as deep as our stack */
+	int open_err;			/* if not 0, "ret" is not set */
+	int ret;
+};
+
+static struct verify_job *jobs;
+static int njobs, nextjob;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int verify_cb(struct sdbfs *fs, struct sdb_device *d, int depth,
+		     sdbfs_off_t base, void *arg)
+{
+	static char names[32][20];
+	struct sdb_product *p = &d->sdb_component.product;
+	struct verify_job *j;
+	int i;
+
+	if (p->record_type != sdb_type_device
+	    && p->record_type != sdb_type_bridge)
+		return SDBFS_WALK_DESCEND;
+	sprintf(names[depth], "%.19s", p->name);
+	for (i = strlen(names[depth]); i > 0 && names[depth][i - 1] == ' ';)
+		names[depth][--i] = '\0';
+	if (p->record_type == sdb_type_bridge)
+		return SDBFS_WALK_DESCEND;
+
+	if (!(njobs & 63)) {
+		jobs = realloc(jobs, (njobs + 64) * sizeof(*jobs));
+		if (!jobs) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	j = jobs + njobs++;
+	j->path[0] = '\0';
+	for (i = 0; i <= depth; i++)
+		sprintf(j->path + strlen(j->path), "%s%s", i ? "/" : "",
+			names[i]);
+	return SDBFS_WALK_DESCEND;
+}
+
+static void *verify_thread(void *arg)
+{
+	struct sdbfs *fs = arg;
+	struct sdbfs_file f;
+	struct verify_job *j;
+
+	for (;;) {
+		pthread_mutex_lock(&job_lock);
+		j = nextjob < njobs ? jobs + nextjob++ : NULL;
+		pthread_mutex_unlock(&job_lock);
+		if (!j)
+			return NULL;
+		j->open_err = sdbfs_file_open_path(&f, fs, j->path);
+		if (j->open_err)
+			continue;
+		j->ret = sdbfs_file_verify(&f);
+		sdbfs_file_close(&f);
+	}
+}
+
+static int do_verify(struct sdbfs *fs)
 {
+	pthread_t th[64];
+	int i, n, ret, err = 0, nodigest = 0;
+
+	ret = sdbfs_walk(fs, verify_cb, NULL);
+	if (ret < 0) {
+		fprintf(stderr, "%s: some bridges not verified: %s\n", prgname,
+			strerror(-ret));
+		err++;
+	}
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > sizeof(th) / sizeof(th[0]))
+		n = sizeof(th) / sizeof(th[0]);
+	if (n > njobs)
+		n = njobs;
+	for (i = 0; i < n; i++)
+		if (pthread_create(th + i, NULL, verify_thread, fs))
+			break;
+	if (!i)
+		verify_thread(fs); /* no threads at all: do it ourselves */
+	while (i--)
+		pthread_join(th[i], NULL);
+
+	for (i = 0; i < njobs; i++) {
+		ret = jobs[i].open_err;
+		if (ret) {
+			fprintf(stderr, "%s: %s: can't open: %s\n", prgname,
+				jobs[i].path, strerror(-ret));
+			err++;
+			continue;
+		}
+		ret = jobs[i].ret;
+		if (ret == -ENOENT) {
+			nodigest++;
+			continue;
+		}
+		if (ret)
+			fprintf(stderr, "%s: %s: %s\n", prgname, jobs[i].path,
+				ret == -EBADMSG ? "digest mismatch"
+				: strerror(-ret));
+		else if (opt_verbose)
+			fprintf(stderr, "%s: ok\n", jobs[i].path);
+		err += ret != 0;
+	}
+	if (nodigest == njobs) {
+		fprintf(stderr, "%s: no digests in this image\n", prgname);
+		return 1;
+	}
+	if (nodigest && opt_verbose)
+		fprintf(stderr, "%s: %i files without a digest\n", prgname,
+			nodigest);
+	return err;
+}
+
+/* Mapped files are written in a single pass, others are read in chunks */
+static void cat_file(struct sdbfs *fs)
+{
+	struct sdbr_drvdata *drvdata = fs->drvdata;
+	const void *data;
+	sdbfs_off_t len;
 	char buf[4096];
+	sdbfs_ssize_t i;
+	struct stat st;
+	off_t first;
+
+	if (sdbfs_fmap(fs, &data, &len) == 0) {
+		/* A regular file gets the holes of the image, if any */
+		if (fstat(STDOUT_FILENO, &st) < 0 || !S_ISREG(st.st_mode)) {
+			fwrite(data, 1, len, stdout);
+			return;
+		}
+		first = drvdata->memaddr
+			+ ((const char *)data - (const char *)fs->data);
+		if (write_sparse(fileno(drvdata->f), STDOUT_FILENO, data,
+				 first, first + len) < 0)
+			fprintf(stderr, "%s: write: %s\n", prgname,
+				strerror(errno));
+		return;
+	}
+	while ( (i = sdbfs_fread(fs, -1, buf, sizeof(buf))) > 0)
+		fwrite(buf, 1, i, stdout);
+}
+
+static int do_cat_name(struct sdbfs *fs, char *name)
+{
 	int i;
 
-	i = sdbfs_open_name(fs, name);
+	if (strchr(name, '/'))
+		i = sdbfs_open_path(fs, name);
+	else
+		i = sdbfs_open_name(fs, name);
 	if (i < 0) {
 		fprintf(stderr, "%s: %s: %s\n", prgname, name, strerror(-i));
 		exit(1);
 	}
-	while ( (i = sdbfs_fread(fs, -1, buf, sizeof(buf))) > 0)
-		fwrite(buf, 1, i, stdout);
+	cat_file(fs);
 	sdbfs_close(fs);
 	return 0;
 }
 
 static int do_cat_id(struct sdbfs *fs, uint64_t vendor, uint32_t dev)
 {
-	char buf[4096];
 	int i;
 
 	i = sdbfs_open_id(fs, htonll(vendor), htonl(dev));
@@ -230,13 +421,139 @@ static int do_cat_id(struct sdbfs *fs, uint64_t vendor, uint32_t dev)
 			(long long)vendor, dev, strerror(-i));
 		exit(1);
 	}
-	while ( (i = sdbfs_fread(fs, -1, buf, sizeof(buf))) > 0)
-		fwrite(buf, 1, i, stdout);
+	cat_file(fs);
 	sdbfs_close(fs);
 	return 0;
 }
 
 /* As promised, here's the user-interface glue (and initialization, I admit) */
+/*
+ * Delta patches, from gensdbfs -E. Before writing, each block of the
+ * target must hold either the old or the new data, so a patch can be
+ * applied again, after an interruption, but not to the wrong image.
+ * Checking reads the whole target, to compare with the image CRC.
+ */
+static int do_patch(char *target, char *patch, int apply)
+{
+	struct sdbfs_patch h;
+	struct sdbfs_patch_block *b;
+	uint64_t pos, size;
+	uint32_t i, n, len, erase, crc;
+	char *buf, *state;
+	int fd, pf, bad = 0, todo = 0;
+	ssize_t ret;
+	struct stat st;
+
+	pf = open(patch, O_RDONLY);
+	if (pf < 0 || read(pf, &h, sizeof(h)) != sizeof(h)) {
+		fprintf(stderr, "%s: %s: %s\n", prgname, patch,
+			pf < 0 ? strerror(errno) : "short file");
+		return 1;
+	}
+	n = ntohl(h.nblocks);
+	erase = ntohl(h.erase_size);
+	size = ntohll(h.image_size);
+	if (ntohl(h.magic) != SDBFS_PATCH_MAGIC || erase > 1 << 30) {
+		fprintf(stderr, "%s: %s: not a patch\n", prgname, patch);
+		return 1;
+	}
+	fd = open(target, apply ? O_RDWR : O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s: %s\n", prgname, target,
+			strerror(errno));
+		return 1;
+	}
+	b = calloc(n, sizeof(*b));
+	state = calloc(n, 1);
+	buf = malloc(erase);
+	if (!b || !state || !buf) {
+		perror("malloc");
+		return 1;
+	}
+
+	/* First pass: what the target holds, for each block */
+	for (pos = sizeof(h), i = 0; i < n; i++, pos += sizeof(*b) + len) {
+		if (pread(pf, b + i, sizeof(*b), pos) != sizeof(*b))
+			goto short_patch;
+		len = ntohl(b[i].length);
+		if (len > erase)
+			goto short_patch;
+		ret = pread(fd, buf, len, ntohll(b[i].offset));
+		crc = sdbfs_crc32c(0, buf, ret < 0 ? 0 : ret);
+		if (ret == len && crc == ntohl(b[i].new_crc))
+			continue; /* already there */
+		state[i] = 1;
+		todo++;
+		if ((ntohl(b[i].flags) & SDBFS_PATCH_ANYOLD)
+		    || (ret == len && crc == ntohl(b[i].old_crc)))
+			continue;
+		state[i] = 2;
+		bad++;
+		if (opt_verbose || !apply)
+			fprintf(stderr, "%s: 0x%08llx: unexpected data\n",
+				prgname, (long long)ntohll(b[i].offset));
+	}
+	if (!apply) {
+		/* Also check the whole image, not just the blocks */
+		for (crc = 0, pos = 0; pos < size; pos += ret) {
+			len = size - pos > erase ? erase : size - pos;
+			ret = pread(fd, buf, len, pos);
+			if (ret <= 0)
+				break;
+			crc = sdbfs_crc32c(crc, buf, ret);
+		}
+		if (pos < size || crc != ntohl(h.image_crc)) {
+			fprintf(stderr, "%s: %s: image checksum mismatch\n",
+				prgname, target);
+			bad++;
+		}
+		printf("%s: %i of %i blocks to be written\n", target, todo, n);
+		return bad ? 1 : 0;
+	}
+	if (bad) {
+		fprintf(stderr, "%s: %s: %i blocks are neither old nor new"
+			" -- not applying\n", prgname, target, bad);
+		return 1;
+	}
+
+	/* Second pass: write what is missing */
+	for (pos = sizeof(h), i = 0; i < n; i++, pos += sizeof(*b) + len) {
+		len = ntohl(b[i].length);
+		if (!state[i])
+			continue;
+		if (pread(pf, buf, len, pos + sizeof(*b)) != len)
+			goto short_patch;
+		if (sdbfs_crc32c(0, buf, len) != ntohl(b[i].new_crc)) {
+			fprintf(stderr, "%s: %s: corrupted block\n",
+				prgname, patch);
+			return 1;
+		}
+		if (pwrite(fd, buf, len, ntohll(b[i].offset)) != len) {
+			fprintf(stderr, "%s: %s: %s\n", prgname, target,
+				strerror(errno));
+			return 1;
+		}
+	}
+	/* A file must end up as the image; a device keeps its size */
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > size
+	    && ftruncate(fd, size) < 0) {
+		fprintf(stderr, "%s: %s: %s\n", prgname, target,
+			strerror(errno));
+		return 1;
+	}
+	if (close(fd) < 0) {
+		fprintf(stderr, "%s: %s: %s\n", prgname, target,
+			strerror(errno));
+		return 1;
+	}
+	printf("%s: %i of %i blocks written\n", target, todo, n);
+	return 0;
+
+short_patch:
+	fprintf(stderr, "%s: %s: short or corrupted patch\n", prgname, patch);
+	return 1;
+}
+
 int main(int argc, char **argv)
 {
 	int c, err;
@@ -251,11 +568,30 @@ int main(int argc, char **argv)
 	unsigned long int32;
 	unsigned long long int64;
 	int pagesize = getpagesize();
+	static char tblbuf[16 * 1024]; /* for read(), not needed if mapped */
+	static char rcache[64 * 1024]; /* same */
+	static struct sdbfs_level stack[32]; /* more than needed, really */
+	static struct option lopts[] = {
+		{"verify", no_argument, NULL, 'c'},
+		{"apply", required_argument, NULL, 'p'},
+		{"check", required_argument, NULL, 'k'},
+		{}
+	};
 
 	prgname = argv[0];
 
-	while ( (c = getopt(argc, argv, "lvre:m:")) != -1) {
+	while ( (c = getopt_long(argc, argv, "lvrace:m:p:k:", lopts,
+				 NULL)) != -1) {
 		switch (c) {
+		case 'c':
+			opt_verify = 1;
+			break;
+		case 'p':
+			opt_apply = optarg;
+			break;
+		case 'k':
+			opt_check = optarg;
+			break;
 		case 'l':
 			opt_long = 1;
 			break;
@@ -265,8 +601,11 @@ int main(int argc, char **argv)
 		case 'r':
 			opt_read = 1;
 			break;
+		case 'a':
+			opt_search = 1;
+			break;
 		case 'e':
-			if (sscanf(optarg, "%i", &opt_entry) != 1) {
+			if (sscanf(optarg, "%lli", &opt_entry) != 1) {
 				fprintf(stderr, "%s: not a number \"%s\"\n",
 					prgname, optarg);
 				exit(1);
@@ -274,10 +613,10 @@ int main(int argc, char **argv)
 			break;
 		case 'm':
 			/* memory:  "size@addr",  "addr+size" (blanks ok) */
-			if (sscanf(optarg, "%li @ %li", &opt_memsize,
+			if (sscanf(optarg, "%lli @ %lli", &opt_memsize,
 				   &opt_memaddr) == 2)
 				break;
-			if (sscanf(optarg, "%li + %li", &opt_memaddr,
+			if (sscanf(optarg, "%lli + %lli", &opt_memaddr,
 				   &opt_memsize) == 2)
 				break;
 
@@ -289,6 +628,14 @@ int main(int argc, char **argv)
 	}
 	if (optind < argc - 2 || optind > argc - 1)
 		help();
+	if ((opt_verify || opt_apply || opt_check) && optind != argc - 1)
+		help();
+
+	/* Patches work on raw data: the target may not be an image yet */
+	if (opt_apply)
+		return do_patch(argv[optind], opt_apply, 1);
+	if (opt_check)
+		return do_patch(argv[optind], opt_check, 0);
 
 	fsname = argv[optind];
 	if (optind + 1 < argc)
@@ -320,30 +667,56 @@ int main(int argc, char **argv)
 
 	fs->drvdata = drvdata;
 	fs->name = fsname; /* not mandatory */
-	fs->blocksize = 256; /* only used for writing, actually */
+	fs->blocksize = 4096; /* we never write: read-cache lines, a page */
 	fs->entrypoint = opt_entry;
-	if (opt_read || !drvdata->mapaddr)
+	fs->stack = stack;
+	fs->maxdepth = sizeof(stack) / sizeof(stack[0]);
+	fs->datalen = opt_memsize ? opt_memsize : stbuf.st_size;
+	if (opt_read || !drvdata->mapaddr) {
 		fs->read = do_read;
-	else
+		fs->tblbuf = tblbuf;
+		fs->tblsize = sizeof(tblbuf);
+	} else {
 		fs->data = mapaddr;
+	}
 	if (opt_verbose)
 		fs->flags |= SDBFS_F_VERBOSE;
+	if (opt_search) {
+		err = sdbfs_find_entry(fs);
+		if (err) {
+			fprintf(stderr, "%s: no sdb table found: %s\n",
+				prgname, strerror(-err));
+			exit(1);
+		}
+		if (opt_verbose)
+			fprintf(stderr, "%s: entry point 0x%08llx\n", prgname,
+				(long long)fs->entrypoint);
+	}
 	err = sdbfs_dev_create(fs);
 	if (err) {
 		fprintf(stderr, "%s: sdbfs_dev_create(): %s\n", prgname,
 			strerror(-err));
-		fprintf(stderr, "\t(wrong entry point 0x%08lx?)\n",
-			fs->entrypoint);
+		fprintf(stderr, "\t(wrong entry point 0x%08llx?)\n",
+			(long long)fs->entrypoint);
 		exit(1);
 	}
+	if (fs->read)
+		sdbfs_rcache_init(fs, rcache, sizeof(rcache), 0);
+
 	/* Now use the thing: either scan, or look for name, or look for id */
-	if (!filearg)
+	if (opt_verify)
+		err = do_verify(fs);
+	else if (!filearg)
 		err = do_list(fs);
 	else if (sscanf(filearg, "%llx:%lx", &int64, &int32) != 2)
 		err = do_cat_name(fs, filearg);
 	else
 		err = do_cat_id(fs, int64, int32);
 
+	if (opt_verbose && fs->rcache)
+		fprintf(stderr, "read cache: %lu hits, %lu misses, "
+			"%lu reads\n", fs->rcache->hits, fs->rcache->misses,
+			fs->rcache->reads);
 	sdbfs_dev_destroy(fs);
 	return err;
 }
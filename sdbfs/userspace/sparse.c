@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2014 CERN (www.cern.ch)
+ * Author: Alessandro Rubini <rubini@gnudd.com>
+ *
+ * Released according to the GNU GPL, version 2 or any later version.
+ *
+ * This work is part of the White Rabbit project, a research effort led
+ * by CERN, the European Institute for Nuclear Research.
+ */
+
+#define _GNU_SOURCE /* for SEEK_DATA and SEEK_HOLE */
+#include <unistd.h>
+#include <errno.h>
+
+#include "sparse.h"
+
+/*
+ * Write a range of the image, skipping the holes it has (SEEK_DATA and
+ * SEEK_HOLE), so sparse images give sparse files. "data" is at "first".
+ */
+int write_sparse(int img, int out, const char *data, off_t first,
+		 off_t last)
+{
+	off_t from, start, end;
+	ssize_t n;
+
+	for (from = first; from < last; from = end) {
+		start = lseek(img, from, SEEK_DATA);
+		if (start < 0 && errno != ENXIO)
+			start = from; /* no hole support: all data */
+		if (start < 0 || start > last)
+			start = last; /* a hole up to the end */
+		end = start < last ? lseek(img, start, SEEK_HOLE) : last;
+		if (end < 0 || end > last)
+			end = last;
+		if (start > from && lseek(out, start - from, SEEK_CUR) < 0)
+			return -1;
+		for (; start < end; start += n) {
+			n = write(out, data + (start - first), end - start);
+			if (n <= 0)
+				return -1;
+		}
+	}
+	/* a trailing hole is only there if we set the size */
+	from = lseek(out, 0, SEEK_CUR);
+	return from < 0 ? -1 : ftruncate(out, from);
+}
@@ -0,0 +1,9 @@
+#ifndef __SPARSE_H__
+#define __SPARSE_H__
+#include <sys/types.h>
+
+/* Shared by sdb-read and sdb-extract, see sparse.c */
+int write_sparse(int img, int out, const char *data, off_t first,
+		 off_t last);
+
+#endif /* __SPARSE_H__ */